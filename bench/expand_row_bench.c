@@ -0,0 +1,89 @@
+/*
+ * Copyright 2016 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Times the glyph row expansion kernels on the row widths of the built-in
+ * font at scales 1 to 4, expanding into a cached buffer.
+ */
+
+#include <string.h>
+
+#include "../font.c"
+
+#define ROWS 4096
+#define PASSES 200
+#define RUNS 5
+
+typedef struct {
+	const char* name;
+	expand_row_t expand;
+} kernel_t;
+
+static uint8_t src[ROWS][4];
+static uint32_t dst[ROWS * 32];
+
+static double time_kernel(expand_row_t expand, int width)
+{
+	double best = 0;
+
+	for (int run = 0; run < RUNS; run++) {
+		struct timespec start, end;
+		double ns;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int pass = 0; pass < PASSES; pass++)
+			for (int row = 0; row < ROWS; row++)
+				expand(&dst[row * 32], src[row], width,
+				       0xffffffff, 0xff000000 + pass);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		ns = (end.tv_sec - start.tv_sec) * 1e9 +
+		     (end.tv_nsec - start.tv_nsec);
+		ns /= (double)PASSES * ROWS;
+		if (run == 0 || ns < best)
+			best = ns;
+	}
+
+	return best;
+}
+
+int main(void)
+{
+	kernel_t kernels[4];
+	int count = 0;
+
+	kernels[count++] = (kernel_t) { "scalar", expand_row_scalar };
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		kernels[count++] = (kernel_t) { "sse2", expand_row_sse2 };
+	if (__builtin_cpu_supports("avx2"))
+		kernels[count++] = (kernel_t) { "avx2", expand_row_avx2 };
+#elif defined(__ARM_NEON)
+	kernels[count++] = (kernel_t) { "neon", expand_row_neon };
+#endif
+
+	srand(1);
+	for (int row = 0; row < ROWS; row++)
+		for (int k = 0; k < 4; k++)
+			src[row][k] = rand();
+
+	printf("ns per glyph row, best of %d runs\n", RUNS);
+	printf("%-8s", "kernel");
+	for (int scale = 1; scale <= 4; scale++)
+		printf("  %2d px", GLYPH_WIDTH * scale);
+	printf("\n");
+
+	for (int i = 0; i < count; i++) {
+		printf("%-8s", kernels[i].name);
+		for (int scale = 1; scale <= 4; scale++)
+			printf(" %6.2f", time_kernel(kernels[i].expand,
+						     GLYPH_WIDTH * scale));
+		printf("\n");
+	}
+
+	return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright 2016 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Times font_init() of the built-in font at scales 1 to 4 and the first
+ * redraw of a 3840x2160 screen after it, and reports how much anonymous
+ * memory each added. Every sample runs in a fresh process, as frecon
+ * starts, and the median of RUNS samples is printed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "screen.h"
+#include "../font.h"
+
+#define PITCH (SCREEN_WIDTH * 4)
+#define RUNS 5
+
+typedef struct {
+	double init_ms, draw_ms;
+	long init_kib, draw_kib;
+} sample_t;
+
+static long rss_anon_kib(void)
+{
+	char line[128];
+	long kib = -1;
+	FILE* f = fopen("/proc/self/status", "r");
+
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "RssAnon: %ld", &kib) == 1)
+			break;
+	fclose(f);
+	return kib;
+}
+
+static sample_t measure(int scale)
+{
+	uint32_t* buffer = malloc(PITCH * SCREEN_HEIGHT);
+	uint32_t char_width, char_height;
+	sample_t s;
+	long kib;
+	double start;
+
+	/* Make the buffer and the screen resident before measuring. */
+	memset(buffer, 0xff, PITCH * SCREEN_HEIGHT);
+	screen_fill(SCREEN_MAX_COLS, SCREEN_MAX_ROWS);
+
+	kib = rss_anon_kib();
+	start = screen_now_ms();
+	font_init(scale);
+	s.init_ms = screen_now_ms() - start;
+	s.init_kib = rss_anon_kib() - kib;
+
+	font_get_size(&char_width, &char_height);
+	kib = rss_anon_kib();
+	start = screen_now_ms();
+	screen_draw(buffer, PITCH, SCREEN_WIDTH / char_width, 0,
+		    SCREEN_HEIGHT / char_height);
+	s.draw_ms = screen_now_ms() - start;
+	s.draw_kib = rss_anon_kib() - kib;
+
+	return s;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int compare_long(const void* a, const void* b)
+{
+	long x = *(const long*)a, y = *(const long*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int main(void)
+{
+	printf("scale  init ms  init KiB  first redraw ms  redraw KiB\n");
+	for (int scale = 1; scale <= 4; scale++) {
+		double init_ms[RUNS], draw_ms[RUNS];
+		long init_kib[RUNS], draw_kib[RUNS];
+
+		for (int run = 0; run < RUNS; run++) {
+			int fds[2];
+			sample_t s;
+			pid_t pid;
+
+			if (pipe(fds) < 0)
+				return 1;
+			pid = fork();
+			if (pid < 0)
+				return 1;
+			if (pid == 0) {
+				s = measure(scale);
+				_exit(write(fds[1], &s, sizeof(s)) != sizeof(s));
+			}
+			close(fds[1]);
+			if (read(fds[0], &s, sizeof(s)) != sizeof(s))
+				return 1;
+			close(fds[0]);
+			waitpid(pid, NULL, 0);
+
+			init_ms[run] = s.init_ms;
+			draw_ms[run] = s.draw_ms;
+			init_kib[run] = s.init_kib;
+			draw_kib[run] = s.draw_kib;
+		}
+
+		qsort(init_ms, RUNS, sizeof(*init_ms), compare_double);
+		qsort(draw_ms, RUNS, sizeof(*draw_ms), compare_double);
+		qsort(init_kib, RUNS, sizeof(*init_kib), compare_long);
+		qsort(draw_kib, RUNS, sizeof(*draw_kib), compare_long);
+		printf("%5d %8.2f %9ld %16.2f %11ld\n", scale,
+		       init_ms[RUNS / 2], init_kib[RUNS / 2],
+		       draw_ms[RUNS / 2], draw_kib[RUNS / 2]);
+	}
+	return 0;
+}
@@ -0,0 +1,264 @@
+/*
+ * Copyright 2016 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Cold start with a font from disk. Writes synthetic PSF2 fonts holding
+ * ASCII and the CJK Unified Ideographs (U+4E00..U+9FFF), then for each of
+ * them and the built-in font, in a fresh process: font_load(), font_init(1)
+ * and the first draw of a 3840x2160 screen of distinct CJK characters.
+ * Reports the time, anonymous memory and page faults of each step, and how
+ * much of the file was paged in. The page cache is hot, as it is after the
+ * first boot. The median of RUNS samples is printed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../font.h"
+
+#define SCREEN_WIDTH		3840
+#define SCREEN_HEIGHT		2160
+#define PITCH			(SCREEN_WIDTH * 4)
+#define RUNS			5
+
+#define PSF2_MAGIC		0x864ab572
+#define PSF2_HAS_UNICODE_TABLE	0x01
+#define CJK_FIRST		0x4e00
+#define CJK_LAST		0x9fff
+#define ASCII_COUNT		128
+#define GLYPH_COUNT		(ASCII_COUNT + CJK_LAST - CJK_FIRST + 1)
+
+typedef struct {
+	double load_ms, draw_ms;
+	long anon_kib, file_kib;
+	long load_faults, draw_faults;
+} sample_t;
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static long faults(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_minflt + usage.ru_majflt;
+}
+
+static long rss_kib(const char* field)
+{
+	char line[128];
+	long kib = -1;
+	size_t len = strlen(field);
+	FILE* f = fopen("/proc/self/status", "r");
+
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f))
+		if (!strncmp(line, field, len) &&
+		    sscanf(line + len, ": %ld", &kib) == 1)
+			break;
+	fclose(f);
+	return kib;
+}
+
+static void put_utf8(FILE* f, uint32_t cp)
+{
+	if (cp < 0x80) {
+		fputc(cp, f);
+	} else if (cp < 0x800) {
+		fputc(0xc0 | cp >> 6, f);
+		fputc(0x80 | (cp & 0x3f), f);
+	} else {
+		fputc(0xe0 | cp >> 12, f);
+		fputc(0x80 | ((cp >> 6) & 0x3f), f);
+		fputc(0x80 | (cp & 0x3f), f);
+	}
+}
+
+static void put_u32(FILE* f, uint32_t value)
+{
+	fwrite(&value, sizeof(value), 1, f);
+}
+
+/* A PSF2 font of |size|x|size| glyphs with noise for bitmaps. */
+static long write_font(const char* path, int size)
+{
+	int charsize = size * ((size + 7) / 8);
+	uint32_t seed = 1;
+	long file_size;
+	FILE* f = fopen(path, "wb");
+
+	if (!f)
+		return -1;
+	put_u32(f, PSF2_MAGIC);
+	put_u32(f, 0);
+	put_u32(f, 32);
+	put_u32(f, PSF2_HAS_UNICODE_TABLE);
+	put_u32(f, GLYPH_COUNT);
+	put_u32(f, charsize);
+	put_u32(f, size);
+	put_u32(f, size);
+	for (int g = 0; g < GLYPH_COUNT; g++) {
+		for (int i = 0; i < charsize; i++) {
+			seed = seed * 1103515245 + 12345;
+			fputc(g == ' ' ? 0 : seed >> 24, f);
+		}
+	}
+	for (int g = 0; g < GLYPH_COUNT; g++) {
+		put_utf8(f, g < ASCII_COUNT ? g : CJK_FIRST + g - ASCII_COUNT);
+		fputc(0xff, f);
+	}
+	file_size = ftell(f);
+	fclose(f);
+	return file_size;
+}
+
+static sample_t measure(const char* path)
+{
+	uint32_t* buffer = malloc(PITCH * SCREEN_HEIGHT);
+	uint32_t char_width, char_height, cp = CJK_FIRST;
+	long anon, file, flt;
+	int cols, rows;
+	sample_t s;
+	double start;
+
+	/* Make the buffer resident before measuring. */
+	memset(buffer, 0xff, PITCH * SCREEN_HEIGHT);
+
+	anon = rss_kib("RssAnon");
+	file = rss_kib("RssFile");
+	flt = faults();
+	start = now_ms();
+	if (path && font_load(path) < 0)
+		exit(1);
+	font_init(1);
+	s.load_ms = now_ms() - start;
+	s.load_faults = faults() - flt;
+	s.anon_kib = rss_kib("RssAnon") - anon;
+
+	font_get_size(&char_width, &char_height);
+	cols = SCREEN_WIDTH / char_width;
+	rows = SCREEN_HEIGHT / char_height;
+	flt = faults();
+	start = now_ms();
+	for (int row = 0; row < rows; row++) {
+		uint32_t chars[SCREEN_WIDTH / 8];
+
+		for (int col = 0; col < cols; col++) {
+			chars[col] = path ? cp : 0x21 + cp % 94;
+			cp = cp == CJK_LAST ? CJK_FIRST : cp + 1;
+		}
+		font_render_span(buffer, 0, row, PITCH, chars, cols,
+				 0xaaaaaa, 0x000000);
+	}
+	s.draw_ms = now_ms() - start;
+	s.draw_faults = faults() - flt;
+	s.file_kib = rss_kib("RssFile") - file;
+
+	return s;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int compare_long(const void* a, const void* b)
+{
+	long x = *(const long*)a, y = *(const long*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int main(void)
+{
+	static const int sizes[] = { 0, 16, 32 };
+	char path[] = "/tmp/font_load_bench.XXXXXX";
+	int fd = mkstemp(path);
+
+	if (fd < 0)
+		return 1;
+	close(fd);
+
+	/* font_free() logs glyph cache statistics. */
+	if (!freopen("/dev/null", "w", stderr))
+		return 1;
+
+	printf("font      file KiB  load ms  anon KiB  faults  draw ms  faults"
+	       "  file KiB in\n");
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		double load_ms[RUNS], draw_ms[RUNS];
+		long anon_kib[RUNS], file_kib[RUNS];
+		long load_faults[RUNS], draw_faults[RUNS];
+		long file_size = 0;
+		char name[16];
+
+		if (sizes[i]) {
+			file_size = write_font(path, sizes[i]);
+			if (file_size < 0)
+				return 1;
+			snprintf(name, sizeof(name), "%dx%d", sizes[i],
+				 sizes[i]);
+		} else {
+			snprintf(name, sizeof(name), "built-in");
+		}
+
+		for (int run = 0; run < RUNS; run++) {
+			int fds[2];
+			sample_t s;
+			pid_t pid;
+
+			if (pipe(fds) < 0)
+				return 1;
+			pid = fork();
+			if (pid < 0)
+				return 1;
+			if (pid == 0) {
+				s = measure(sizes[i] ? path : NULL);
+				_exit(write(fds[1], &s, sizeof(s)) != sizeof(s));
+			}
+			close(fds[1]);
+			if (read(fds[0], &s, sizeof(s)) != sizeof(s))
+				return 1;
+			close(fds[0]);
+			waitpid(pid, NULL, 0);
+
+			load_ms[run] = s.load_ms;
+			draw_ms[run] = s.draw_ms;
+			anon_kib[run] = s.anon_kib;
+			file_kib[run] = s.file_kib;
+			load_faults[run] = s.load_faults;
+			draw_faults[run] = s.draw_faults;
+		}
+
+		qsort(load_ms, RUNS, sizeof(*load_ms), compare_double);
+		qsort(draw_ms, RUNS, sizeof(*draw_ms), compare_double);
+		qsort(anon_kib, RUNS, sizeof(*anon_kib), compare_long);
+		qsort(file_kib, RUNS, sizeof(*file_kib), compare_long);
+		qsort(load_faults, RUNS, sizeof(*load_faults), compare_long);
+		qsort(draw_faults, RUNS, sizeof(*draw_faults), compare_long);
+		printf("%-9s %8ld %8.2f %9ld %7ld %8.2f %7ld %12ld\n", name,
+		       file_size / 1024, load_ms[RUNS / 2], anon_kib[RUNS / 2],
+		       load_faults[RUNS / 2], draw_ms[RUNS / 2],
+		       draw_faults[RUNS / 2], file_kib[RUNS / 2]);
+	}
+
+	unlink(path);
+	return 0;
+}
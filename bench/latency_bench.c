@@ -0,0 +1,337 @@
+/*
+ * Copyright 2016 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Measures key latency while a terminal is flooded, with and without the
+ * render thread. The main thread runs the event loop of event.c, reads a
+ * flooding pty through shl_pty with the adaptive budget of term.c, and
+ * captures a cell grid that is drawn with font.c, on the render thread or
+ * inline. Another thread writes a timestamped key into a high priority
+ * pipe every 2 ms. Every 25 ms a VT switch (full redraw) or a hotplug
+ * (new buffer, font at another scale) runs after render_wait().
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../event.h"
+#include "../font.h"
+#include "../render.h"
+#include "../shl_pty.h"
+#include "../util.h"
+
+#define COLS 160
+#define ROWS 48
+#define SECONDS 3
+#define KEY_INTERVAL_US 2000
+#define SWITCH_INTERVAL_NS 25000000
+#define MAX_SAMPLES (SECONDS * 1000000 / KEY_INTERVAL_US + 64)
+
+typedef struct {
+	uint32_t ch, fg, bg;
+} cell_t;
+
+static int width, height, pitch;
+static uint32_t* buffer;
+/* What the terminal holds, the captured frame and what the buffer holds. */
+static cell_t* screen;
+static cell_t* cells;
+static cell_t* prev_cells;
+static bool prev_valid;
+static int cur_x, cur_y;
+static bool dirty;
+static int scale;
+static size_t pty_budget;
+static uint64_t bytes, frames;
+
+static int64_t latency[MAX_SAMPLES];
+static int samples;
+static bool typing;
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Writes base64 like lines to the pty slave until killed. */
+static void flood(void)
+{
+	static const char alphabet[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char buf[4096];
+
+	for (size_t i = 0; i < sizeof(buf); i++)
+		buf[i] = i % 77 == 76 ? '\n' : alphabet[(i * 7919) % 64];
+
+	for (;;)
+		if (write(1, buf, sizeof(buf)) < 0 && errno != EINTR)
+			_exit(1);
+}
+
+/* A minimal VTE: printable bytes, newlines and scrolling. */
+static void pty_input(struct shl_pty* pty, char* u8, size_t len, void* data)
+{
+	bytes += len;
+	for (size_t i = 0; i < len; i++) {
+		cell_t* c;
+
+		if (u8[i] == '\n' || cur_x == COLS) {
+			cur_x = 0;
+			if (++cur_y == ROWS) {
+				memmove(screen, screen + COLS,
+					(ROWS - 1) * COLS * sizeof(*screen));
+				memset(screen + (ROWS - 1) * COLS, 0,
+				       COLS * sizeof(*screen));
+				cur_y = ROWS - 1;
+			}
+			if (u8[i] == '\n')
+				continue;
+		}
+		c = &screen[cur_y * COLS + cur_x++];
+		c->ch = (unsigned char)u8[i];
+		c->fg = 0xffffff - (c->ch & 7) * 0x111111;
+		c->bg = 0;
+	}
+	dirty = true;
+}
+
+/* As term_pty_event(), without the input_pending() check. */
+static void pty_event(uint32_t events, void* data)
+{
+	struct shl_pty* pty = data;
+
+	if (!(events & EPOLLIN))
+		return;
+	if (shl_pty_dispatch_budget(pty, pty_budget, 2000000) == -EAGAIN)
+		pty_budget = MIN(pty_budget * 2, 1024 * 1024);
+	else
+		pty_budget = MAX(pty_budget / 2, 16 * 1024);
+}
+
+/* As term_grid_draw(), rows that did not change are skipped. */
+static void grid_draw(void* data)
+{
+	for (int r = 0; r < ROWS; r++) {
+		const cell_t* row = &cells[r * COLS];
+
+		if (prev_valid && !memcmp(row, &prev_cells[r * COLS],
+					  COLS * sizeof(*row)))
+			continue;
+		for (int c = 0; c < COLS;) {
+			uint32_t chars[COLS];
+			int n = 0;
+
+			do {
+				chars[n] = row[c + n].ch ? row[c + n].ch : ' ';
+				n++;
+			} while (c + n < COLS && row[c + n].fg == row[c].fg);
+			font_render_span(buffer, c, r, pitch, chars, n,
+					 row[c].fg, row[c].bg);
+			c += n;
+		}
+	}
+}
+
+static void grid_end(void* data)
+{
+	cell_t* tmp = prev_cells;
+
+	prev_cells = cells;
+	cells = tmp;
+	prev_valid = true;
+	frames++;
+}
+
+static void redraw(bool use_thread)
+{
+	if (!dirty || render_busy())
+		return;
+
+	dirty = false;
+	memcpy(cells, screen, ROWS * COLS * sizeof(*cells));
+	if (use_thread && render_submit(grid_draw, grid_end, NULL))
+		return;
+	grid_draw(NULL);
+	grid_end(NULL);
+}
+
+static void alloc_buffer(void)
+{
+	uint32_t char_width, char_height;
+
+	font_get_size(&char_width, &char_height);
+	width = COLS * char_width;
+	height = ROWS * char_height;
+	pitch = width * 4;
+	free(buffer);
+	buffer = calloc(width * height, 4);
+	prev_valid = false;
+}
+
+static void switch_event(uint32_t events, void* data)
+{
+	static unsigned count;
+	int fd = *(int*)data;
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	render_wait();
+	if (count++ % 2) {
+		font_free();
+		scale = scale == 1 ? 2 : 1;
+		font_init(scale);
+		alloc_buffer();
+	} else {
+		prev_valid = false;
+	}
+	dirty = true;
+}
+
+static void key_event(uint32_t events, void* data)
+{
+	int fd = *(int*)data;
+	int64_t sent[64];
+	ssize_t r = read(fd, sent, sizeof(sent));
+	int64_t now = now_ns();
+
+	for (ssize_t i = 0; i < r / (ssize_t)sizeof(*sent); i++)
+		if (samples < MAX_SAMPLES)
+			latency[samples++] = now - sent[i];
+}
+
+static void* typist(void* arg)
+{
+	int fd = *(int*)arg;
+
+	while (__atomic_load_n(&typing, __ATOMIC_RELAXED)) {
+		int64_t now = now_ns();
+
+		if (write(fd, &now, sizeof(now)) < 0)
+			break;
+		usleep(KEY_INTERVAL_US);
+	}
+	return NULL;
+}
+
+static int compare_latency(const void* a, const void* b)
+{
+	int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void run(bool flooded, bool use_thread)
+{
+	struct itimerspec timer = {
+		{ 0, SWITCH_INTERVAL_NS }, { 0, SWITCH_INTERVAL_NS }
+	};
+	event_source_t *pty_source = NULL, *key_source, *timer_source;
+	struct shl_pty* pty = NULL;
+	pthread_t thread;
+	int keys[2], timer_fd;
+	pid_t pid = 0;
+	int64_t end;
+
+	samples = 0;
+	bytes = frames = 0;
+	scale = 1;
+	pty_budget = 16 * 1024;
+	cur_x = cur_y = 0;
+	dirty = false;
+
+	if (event_init() < 0)
+		exit(1);
+	font_init(scale);
+	alloc_buffer();
+	memset(screen, 0, ROWS * COLS * sizeof(*screen));
+
+	if (flooded) {
+		pid = shl_pty_open(&pty, pty_input, NULL, COLS, ROWS, -1);
+		if (pid < 0)
+			exit(1);
+		if (pid == 0)
+			flood();
+		pty_source = event_add(shl_pty_get_fd(pty), EPOLLIN,
+				       pty_event, pty);
+	}
+
+	if (pipe(keys) < 0)
+		exit(1);
+	key_source = event_add(keys[0], EPOLLIN, key_event, &keys[0]);
+	event_set_priority(key_source, true);
+	typing = true;
+	pthread_create(&thread, NULL, typist, &keys[1]);
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	timerfd_settime(timer_fd, 0, &timer, NULL);
+	timer_source = event_add(timer_fd, EPOLLIN, switch_event, &timer_fd);
+	if (!key_source || !timer_source || (flooded && !pty_source))
+		exit(1);
+
+	end = now_ns() + SECONDS * 1000000000LL;
+	while (now_ns() < end) {
+		event_dispatch(dirty && !render_busy() ? 0 : 10);
+		redraw(use_thread);
+	}
+
+	__atomic_store_n(&typing, false, __ATOMIC_RELAXED);
+	pthread_join(thread, NULL);
+	render_close();
+	if (pty) {
+		event_remove(pty_source);
+		kill(pid, SIGKILL);
+		shl_pty_close(pty);
+		shl_pty_unref(pty);
+		waitpid(pid, NULL, 0);
+	}
+	event_remove(key_source);
+	event_remove(timer_source);
+	close(keys[0]);
+	close(keys[1]);
+	close(timer_fd);
+	event_close();
+	font_free();
+
+	qsort(latency, samples, sizeof(*latency), compare_latency);
+	printf("%-5s %-6s %8.3f %8.3f %8.3f %8.1f %7llu\n",
+	       flooded ? "yes" : "no", use_thread ? "yes" : "no",
+	       latency[samples / 2] / 1e6, latency[samples * 99 / 100] / 1e6,
+	       latency[samples - 1] / 1e6, bytes / 1e6 / SECONDS,
+	       (unsigned long long)frames);
+}
+
+int main(void)
+{
+	screen = calloc(ROWS * COLS, sizeof(*screen));
+	cells = calloc(ROWS * COLS, sizeof(*cells));
+	prev_cells = calloc(ROWS * COLS, sizeof(*prev_cells));
+	if (!screen || !cells || !prev_cells)
+		return 1;
+
+	/* font_free() logs glyph cache statistics on every hotplug. */
+	if (!freopen("/dev/null", "w", stderr))
+		return 1;
+
+	printf("key latency in ms, %d s per run\n", SECONDS);
+	printf("%-5s %-6s %8s %8s %8s %8s %7s\n", "flood", "thread",
+	       "p50", "p99", "max", "MB/s", "frames");
+	for (int i = 0; i < 4; i++)
+		run(i / 2, i % 2);
+	return 0;
+}
@@ -0,0 +1,351 @@
+/*
+ * Copyright 2016 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Counts the system calls of the main loop while a terminal is flooded
+ * with output, like strace -c would. The loop is run once the way
+ * main_process_events() did it with select(), one pty bridge per terminal
+ * and a waitpid() per iteration, and once with the event loop of event.c,
+ * pty masters and a pidfd registered directly.
+ *
+ * Both loops share the redraw timerfd of term_schedule_redraw(), but skip
+ * the rendering itself, which makes the same calls either way.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/select.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <elf.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Newer C libraries no longer define it, shl_pty.c only needs the count. */
+#ifndef SIGUNUSED
+#define SIGUNUSED SIGSYS
+#endif
+
+#include "../event.c"
+#include "../shl_pty.c"
+
+#define TERMINALS 3
+#define FLOOD_BYTES (16 * 1024 * 1024)
+#define FRAME_NS 16666667
+
+typedef struct {
+	struct shl_pty* pty;
+	int bridge;
+	event_source_t* pty_source;
+	bool pty_hup;
+} loop_term_t;
+
+static loop_term_t terms[TERMINALS];
+static size_t bytes_read;
+static int timer_fd;
+static event_source_t* timer_source;
+static bool timer_armed;
+static bool child_done;
+
+/* Writes FLOOD_BYTES of 'ls -l' like lines to the pty slave. */
+static void flood(void)
+{
+	static const char line[] =
+		"-rw-r--r-- 1 root root     1234 Oct 12 10:00 0123456789abcdef\n";
+	char buf[4096];
+	size_t left = FLOOD_BYTES;
+
+	for (size_t i = 0; i < sizeof(buf); i++)
+		buf[i] = line[i % (sizeof(line) - 1)];
+
+	while (left > 0) {
+		ssize_t n = write(1, buf, left < sizeof(buf) ? left : sizeof(buf));
+
+		if (n < 0 && errno != EINTR)
+			_exit(1);
+		if (n > 0)
+			left -= n;
+	}
+	_exit(0);
+}
+
+static void schedule_redraw(void)
+{
+	struct itimerspec timer;
+
+	if (timer_armed)
+		return;
+
+	memset(&timer, 0, sizeof(timer));
+	timer.it_value.tv_nsec = FRAME_NS;
+	timerfd_settime(timer_fd, 0, &timer, NULL);
+	timer_armed = true;
+}
+
+static void timer_expired(void)
+{
+	uint64_t expirations;
+
+	if (read(timer_fd, &expirations, sizeof(expirations)) > 0)
+		timer_armed = false;
+}
+
+static void pty_input(struct shl_pty* pty, char* u8, size_t len, void* data)
+{
+	bytes_read += len;
+	schedule_redraw();
+}
+
+static pid_t open_terms(void)
+{
+	pid_t flood_pid = 0;
+
+	for (int i = 0; i < TERMINALS; i++) {
+		pid_t pid = shl_pty_open(&terms[i].pty, pty_input, &terms[i],
+					 80, 25, -1);
+
+		if (pid < 0)
+			exit(1);
+		if (pid == 0) {
+			if (i == 0)
+				flood();
+			pause();
+			_exit(0);
+		}
+		if (i == 0)
+			flood_pid = pid;
+	}
+	return flood_pid;
+}
+
+static void close_terms(void)
+{
+	for (int i = 0; i < TERMINALS; i++) {
+		pid_t pid = shl_pty_get_child(terms[i].pty);
+
+		kill(pid, SIGKILL);
+		shl_pty_close(terms[i].pty);
+		shl_pty_unref(terms[i].pty);
+		waitpid(pid, NULL, 0);
+	}
+}
+
+/* The loop before the event loop, as in main_process_events(). */
+static void run_select(pid_t flood_pid)
+{
+	for (int i = 0; i < TERMINALS; i++) {
+		terms[i].bridge = shl_pty_bridge_new();
+		shl_pty_bridge_add(terms[i].bridge, terms[i].pty);
+	}
+
+	while (bytes_read < FLOOD_BYTES) {
+		fd_set read_set, exception_set;
+		int maxfd = timer_fd;
+
+		FD_ZERO(&read_set);
+		FD_ZERO(&exception_set);
+		for (int i = 0; i < TERMINALS; i++) {
+			FD_SET(terms[i].bridge, &read_set);
+			FD_SET(terms[i].bridge, &exception_set);
+			if (terms[i].bridge > maxfd)
+				maxfd = terms[i].bridge;
+		}
+		FD_SET(timer_fd, &read_set);
+
+		if (select(maxfd + 1, &read_set, NULL, &exception_set,
+			   NULL) <= 0)
+			continue;
+
+		for (int i = 0; i < TERMINALS; i++)
+			if (FD_ISSET(terms[i].bridge, &read_set))
+				shl_pty_bridge_dispatch(terms[i].bridge, 0);
+		if (FD_ISSET(timer_fd, &read_set))
+			timer_expired();
+
+		if (!child_done && waitpid(flood_pid, NULL, WNOHANG) > 0)
+			child_done = true;
+	}
+
+	for (int i = 0; i < TERMINALS; i++) {
+		shl_pty_bridge_remove(terms[i].bridge, terms[i].pty);
+		shl_pty_bridge_free(terms[i].bridge);
+	}
+}
+
+/* As term_pty_event(). */
+static void pty_event(uint32_t events, void* data)
+{
+	loop_term_t* term = data;
+
+	if (events & (EPOLLHUP | EPOLLERR)) {
+		if (!term->pty_hup) {
+			event_modify(term->pty_source, EPOLLIN | EPOLLET);
+			term->pty_hup = true;
+		}
+		while (shl_pty_dispatch(term->pty) == -EAGAIN)
+			;
+		return;
+	}
+
+	if (term->pty_hup) {
+		event_modify(term->pty_source, EPOLLIN);
+		term->pty_hup = false;
+	}
+	shl_pty_dispatch(term->pty);
+}
+
+static void timer_event(uint32_t events, void* data)
+{
+	timer_expired();
+}
+
+static void child_event(uint32_t events, void* data)
+{
+	waitpid(*(pid_t*)data, NULL, WNOHANG);
+	child_done = true;
+}
+
+static void run_epoll(pid_t flood_pid)
+{
+	event_source_t* pid_source;
+	int pidfd;
+
+	event_init();
+	for (int i = 0; i < TERMINALS; i++)
+		terms[i].pty_source = event_add(shl_pty_get_fd(terms[i].pty),
+						EPOLLIN, pty_event, &terms[i]);
+	timer_source = event_add(timer_fd, EPOLLIN, timer_event, NULL);
+	pidfd = syscall(SYS_pidfd_open, flood_pid, 0);
+	pid_source = event_add(pidfd, EPOLLIN, child_event, &flood_pid);
+
+	while (bytes_read < FLOOD_BYTES)
+		event_dispatch(-1);
+
+	event_remove(pid_source);
+	close(pidfd);
+	event_remove(timer_source);
+	for (int i = 0; i < TERMINALS; i++)
+		event_remove(terms[i].pty_source);
+	event_close();
+}
+
+static long syscall_nr(pid_t pid)
+{
+	struct user_regs_struct regs;
+	struct iovec iov = { &regs, sizeof(regs) };
+
+	if (ptrace(PTRACE_GETREGSET, pid, NT_PRSTATUS, &iov) < 0)
+		return -1;
+#if defined(__x86_64__)
+	return regs.orig_rax;
+#elif defined(__i386__)
+	return regs.orig_eax;
+#elif defined(__aarch64__)
+	return regs.regs[8];
+#else
+	return -1;
+#endif
+}
+
+typedef struct {
+	const char* name;
+	long nr;
+} syscall_name_t;
+
+static const syscall_name_t syscall_names[] = {
+	{ "read", SYS_read },
+#ifdef SYS_select
+	{ "select", SYS_select },
+#endif
+	{ "pselect6", SYS_pselect6 },
+#ifdef SYS_epoll_wait
+	{ "epoll_wait", SYS_epoll_wait },
+#endif
+	{ "epoll_pwait", SYS_epoll_pwait },
+	{ "epoll_ctl", SYS_epoll_ctl },
+	{ "wait4", SYS_wait4 },
+	{ "waitid", SYS_waitid },
+	{ "timerfd_settime", SYS_timerfd_settime },
+};
+
+/*
+ * Runs |loop| in a traced child, once the ptys are set up, and prints how
+ * often each system call was entered.
+ */
+static void count(const char* name, void (*loop)(pid_t flood_pid))
+{
+	unsigned long counts[ARRAY_SIZE(syscall_names)] = { 0 };
+	unsigned long other = 0, total = 0;
+	bool in_syscall = false;
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid == 0) {
+		pid_t flood_pid;
+
+		timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					  TFD_NONBLOCK | TFD_CLOEXEC);
+		flood_pid = open_terms();
+		ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+		raise(SIGSTOP);
+		loop(flood_pid);
+		raise(SIGSTOP);
+		close_terms();
+		_exit(0);
+	}
+
+	/* Count from the first stop to the second one. */
+	waitpid(pid, &status, 0);
+	for (;;) {
+		long nr;
+
+		ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+		waitpid(pid, &status, 0);
+		if (!WIFSTOPPED(status) || WSTOPSIG(status) != SIGTRAP)
+			break;
+		in_syscall = !in_syscall;
+		if (!in_syscall)
+			continue;
+
+		nr = syscall_nr(pid);
+		total++;
+		for (unsigned i = 0; i < ARRAY_SIZE(syscall_names); i++) {
+			if (syscall_names[i].nr == nr) {
+				counts[i]++;
+				nr = -1;
+			}
+		}
+		if (nr >= 0)
+			other++;
+	}
+	ptrace(PTRACE_DETACH, pid, NULL, NULL);
+	waitpid(pid, &status, 0);
+
+	printf("%s: %lu calls for %d MiB\n", name, total,
+	       FLOOD_BYTES / (1024 * 1024));
+	for (unsigned i = 0; i < ARRAY_SIZE(syscall_names); i++)
+		if (counts[i])
+			printf("  %-16s %8lu\n", syscall_names[i].name,
+			       counts[i]);
+	if (other)
+		printf("  %-16s %8lu\n", "other", other);
+}
+
+int main(void)
+{
+	count("select", run_select);
+	count("epoll", run_epoll);
+	return 0;
+}
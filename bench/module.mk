@@ -0,0 +1,36 @@
+# Copyright 2016 The Chromium OS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+
+include common.mk
+
+CC_BINARY(bench/redraw_bench): bench/redraw_bench.o util.o
+BENCHMARKS += bench/redraw_bench
+
+bench/expand_row_bench.o.depends: $(OUT)glyphs.h
+CC_BINARY(bench/expand_row_bench): bench/expand_row_bench.o util.o
+BENCHMARKS += bench/expand_row_bench
+
+bench/render_bench.o.depends: $(OUT)glyphs.h
+CC_BINARY(bench/render_bench): bench/render_bench.o bench/screen.o util.o
+BENCHMARKS += bench/render_bench
+
+CC_BINARY(bench/shadow_bench): bench/shadow_bench.o bench/screen.o font.o util.o
+BENCHMARKS += bench/shadow_bench
+
+CC_BINARY(bench/loop_bench): bench/loop_bench.o util.o
+BENCHMARKS += bench/loop_bench
+
+CC_BINARY(bench/ring_bench): bench/ring_bench.o util.o
+BENCHMARKS += bench/ring_bench
+
+CC_BINARY(bench/latency_bench): bench/latency_bench.o render.o event.o \
+	shl_pty.o font.o util.o
+BENCHMARKS += bench/latency_bench
+
+CC_BINARY(bench/font_init_bench): bench/font_init_bench.o bench/screen.o \
+	font.o util.o
+BENCHMARKS += bench/font_init_bench
+
+CC_BINARY(bench/font_load_bench): bench/font_load_bench.o font.o util.o
+BENCHMARKS += bench/font_load_bench
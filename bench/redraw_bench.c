@@ -0,0 +1,176 @@
+/*
+ * Copyright 2016 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Floods a terminal with output and drains it through shl_pty.c and a
+ * select() loop like main_process_events(). The terminal is redrawn once
+ * after every pty read, as term_read_cb() used to do, and once paced to a
+ * 60 Hz redraw timerfd, as term_schedule_redraw() does.
+ *
+ * A frame is modeled as a full write of a 3840x2160 32bpp buffer, which
+ * is what a scrolling screen costs to redraw at that resolution.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Newer C libraries no longer define it, shl_pty.c only needs the count. */
+#ifndef SIGUNUSED
+#define SIGUNUSED SIGSYS
+#endif
+
+#include "../shl_pty.c"
+
+#define FLOOD_BYTES (16 * 1024 * 1024)
+#define FRAME_NS 16666667
+#define FRAME_PIXELS (3840 * 2160)
+
+static uint32_t* frame;
+static unsigned frames;
+static size_t bytes_read;
+static bool paced;
+static int timer_fd;
+static bool timer_armed;
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Writes FLOOD_BYTES of 'ls -l' like lines to the pty slave. */
+static void flood(void)
+{
+	static const char line[] =
+		"-rw-r--r-- 1 root root     1234 Oct 12 10:00 0123456789abcdef\n";
+	char buf[4096];
+	size_t left = FLOOD_BYTES;
+
+	for (size_t i = 0; i < sizeof(buf); i++)
+		buf[i] = line[i % (sizeof(line) - 1)];
+
+	while (left > 0) {
+		ssize_t n = write(1, buf, left < sizeof(buf) ? left : sizeof(buf));
+
+		if (n < 0 && errno != EINTR)
+			_exit(1);
+		if (n > 0)
+			left -= n;
+	}
+	pause();
+	_exit(0);
+}
+
+static void redraw(void)
+{
+	memset(frame, frames & 0xff, FRAME_PIXELS * sizeof(*frame));
+	frames++;
+}
+
+static void pty_input(struct shl_pty* pty, char* u8, size_t len, void* data)
+{
+	struct itimerspec timer;
+
+	bytes_read += len;
+
+	if (!paced) {
+		redraw();
+		return;
+	}
+	if (timer_armed)
+		return;
+
+	memset(&timer, 0, sizeof(timer));
+	timer.it_value.tv_nsec = FRAME_NS;
+	timerfd_settime(timer_fd, 0, &timer, NULL);
+	timer_armed = true;
+}
+
+static void run(bool pace)
+{
+	struct shl_pty* pty;
+	int64_t start, elapsed;
+	pid_t pid;
+	int bridge;
+
+	paced = pace;
+	frames = 0;
+	bytes_read = 0;
+	timer_armed = false;
+
+	pid = shl_pty_open(&pty, pty_input, NULL, 80, 25, -1);
+	if (pid < 0)
+		exit(1);
+	if (pid == 0)
+		flood();
+
+	bridge = shl_pty_bridge_new();
+	shl_pty_bridge_add(bridge, pty);
+
+	start = now_ns();
+	while (bytes_read < FLOOD_BYTES) {
+		fd_set read_set;
+		int maxfd = bridge > timer_fd ? bridge : timer_fd;
+
+		FD_ZERO(&read_set);
+		FD_SET(bridge, &read_set);
+		FD_SET(timer_fd, &read_set);
+
+		if (select(maxfd + 1, &read_set, NULL, NULL, NULL) <= 0)
+			continue;
+
+		if (FD_ISSET(bridge, &read_set))
+			shl_pty_bridge_dispatch(bridge, 0);
+		if (FD_ISSET(timer_fd, &read_set)) {
+			uint64_t expirations;
+
+			if (read(timer_fd, &expirations, sizeof(expirations)) > 0) {
+				timer_armed = false;
+				redraw();
+			}
+		}
+	}
+	elapsed = now_ns() - start;
+
+	printf("%-10s %8u %10.1f %8.1f\n", pace ? "paced" : "per read",
+	       frames, elapsed / 1e6,
+	       FLOOD_BYTES / (1024.0 * 1024.0) / (elapsed / 1e9));
+
+	shl_pty_bridge_remove(bridge, pty);
+	shl_pty_bridge_free(bridge);
+	kill(pid, SIGKILL);
+	shl_pty_close(pty);
+	shl_pty_unref(pty);
+	waitpid(pid, NULL, 0);
+}
+
+int main(void)
+{
+	frame = malloc(FRAME_PIXELS * sizeof(*frame));
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (!frame || timer_fd < 0)
+		return 1;
+
+	printf("%d MiB of output, %dx%d frames\n", FLOOD_BYTES >> 20, 3840, 2160);
+	printf("%-10s %8s %10s %8s\n", "redraw", "frames", "ms", "MiB/s");
+	run(false);
+	run(true);
+
+	free(frame);
+	close(timer_fd);
+	return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright 2016 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Times full redraws of a 3840x2160 screen filled with colored 'ls -l'
+ * output at scales 1 to 4. Cells are drawn one at a time, and in spans of
+ * same-colored cells the way term_draw_cell() collects them. Each redraw
+ * is timed with the kernel picked for the CPU and with the scalar one.
+ */
+
+#include <string.h>
+
+#include "../font.c"
+#include "screen.h"
+
+#define RUNS 30
+
+static int cols, rows;
+static uint32_t* buffer;
+
+static void redraw_cells(void)
+{
+	screen_draw_cells(buffer, SCREEN_WIDTH * 4, cols, 0, rows);
+}
+
+static void redraw_spans(void)
+{
+	screen_draw(buffer, SCREEN_WIDTH * 4, cols, 0, rows);
+}
+
+static void (*redraw)(void) = redraw_cells;
+
+/* Returns the best redraw time in ms after a first redraw. */
+static double time_redraw(ssize_t cache_size)
+{
+	double best = 0;
+
+	glyph_cache.size_set = cache_size >= 0;
+	glyph_cache.size = cache_size;
+	glyph_cache_flush();
+	redraw();
+	glyph_cache.hits = 0;
+	glyph_cache.misses = 0;
+
+	for (int i = 0; i < RUNS; i++) {
+		double start = screen_now_ms();
+		double ms;
+
+		redraw();
+		ms = screen_now_ms() - start;
+		if (i == 0 || ms < best)
+			best = ms;
+	}
+
+	return best;
+}
+
+/*
+ * Prints redraw times cell by cell and in spans, with the best kernel and
+ * the scalar one.
+ */
+static void run(const char* name, int scaling, ssize_t cache_size)
+{
+	expand_row_t best_kernel = expand_row;
+
+	printf("%d      %-10s", scaling, name);
+	for (int k = 0; k < 2; k++) {
+		expand_row = k ? expand_row_scalar : best_kernel;
+		redraw = redraw_cells;
+		printf(" %7.2f ms", time_redraw(cache_size));
+		redraw = redraw_spans;
+		printf(" %7.2f ms", time_redraw(cache_size));
+	}
+	expand_row = best_kernel;
+
+	if (glyph_cache.max_entries)
+		printf("   %5.1f%% hits, %d entries", 100.0 * glyph_cache.hits /
+		       (glyph_cache.hits + glyph_cache.misses),
+		       glyph_cache.max_entries);
+	printf("\n");
+}
+
+int main(void)
+{
+	buffer = malloc(SCREEN_WIDTH * SCREEN_HEIGHT * 4);
+	if (!buffer)
+		return 1;
+	memset(buffer, 1, SCREEN_WIDTH * SCREEN_HEIGHT * 4);
+
+	printf("scale  %-10s %10s %10s %10s %10s\n", "cache", "cells", "spans",
+	       "scalar", "scalar");
+	for (int scaling = 1; scaling <= 4; scaling++) {
+		font_init(scaling);
+		cols = SCREEN_WIDTH / (GLYPH_WIDTH * scaling);
+		rows = SCREEN_HEIGHT / (GLYPH_HEIGHT * scaling);
+		screen_fill(cols, rows);
+
+		run("none", scaling, 0);
+		run("1 MiB", scaling, 1024 * 1024);
+		run("default", scaling, -1);
+		font_free();
+	}
+
+	free(buffer);
+	return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright 2016 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Times pastes through the shl_pty output ring, with the mirrored memfd
+ * ring and with the heap ring it replaced. A paste is pushed in 16 KiB
+ * pieces while the pty takes 4 KiB after each of them, so the ring grows
+ * while its data wraps around, and is then drained. Writes to the pty are
+ * modeled by copying the peeked iovecs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Newer C libraries no longer define it, shl_pty.c only needs the count. */
+#ifndef SIGUNUSED
+#define SIGUNUSED SIGSYS
+#endif
+
+#include "../shl_pty.c"
+
+#define PIECE (16 * 1024)
+#define PTY_TAKES (4 * 1024)
+#define RUNS 5
+
+static char piece[PIECE];
+static char sink[PTY_TAKES];
+static size_t split_flushes;
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* Like shl_pty_flush() against a pty that takes PTY_TAKES bytes. */
+static size_t flush(struct ring* r)
+{
+	struct iovec vec[2];
+	size_t num, len = 0;
+
+	num = ring_peek(r, vec);
+	if (num == 2)
+		split_flushes++;
+	for (size_t i = 0; i < num && len < PTY_TAKES; i++) {
+		size_t l = vec[i].iov_len;
+
+		if (l > PTY_TAKES - len)
+			l = PTY_TAKES - len;
+		memcpy(sink + len, vec[i].iov_base, l);
+		len += l;
+	}
+	ring_pop(r, len);
+	return len;
+}
+
+static double paste(size_t size, bool heap)
+{
+	double best = 0;
+
+	for (int run = 0; run < RUNS; run++) {
+		struct ring r = { .fd = -1 };
+		double start;
+
+		split_flushes = 0;
+		start = now_ms();
+		if (heap)
+			ring_resize_heap(&r, sysconf(_SC_PAGESIZE));
+		for (size_t pushed = 0; pushed < size; pushed += PIECE) {
+			ring_push(&r, piece, PIECE);
+			flush(&r);
+		}
+		while (flush(&r))
+			;
+		ring_free(&r);
+
+		if (run == 0 || now_ms() - start < best)
+			best = now_ms() - start;
+	}
+	return best;
+}
+
+int main(void)
+{
+	static const size_t sizes[] = { 64 << 10, 1 << 20, 16 << 20 };
+
+	memset(piece, 'x', sizeof(piece));
+
+	printf("%-8s %10s %10s %12s\n", "paste", "heap ms", "memfd ms",
+	       "heap splits");
+	for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		double heap = paste(sizes[i], true);
+		size_t splits = split_flushes;
+		double mirrored = paste(sizes[i], false);
+
+		printf("%5zu KiB %10.2f %10.2f %12zu\n", sizes[i] >> 10, heap,
+		       mirrored, splits);
+	}
+	return 0;
+}
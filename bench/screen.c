@@ -0,0 +1,150 @@
+/*
+ * Copyright 2016 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Screen contents for the benchmarks: lines like "-rw-r--r-- 1 root root
+ * 1234 ..." with random file names, colored by type as with ls --color.
+ *
+ * The drawing is kept in this file so that calls into font.c are not
+ * inlined, as with term.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "screen.h"
+#include "../font.h"
+#include "../util.h"
+
+#define SPAN_MAX		256
+
+#define COLOR_DIR		0x5555ff
+#define COLOR_EXEC		0x55ff55
+#define COLOR_LINK		0x55ffff
+#define COLOR_ARCHIVE		0xff5555
+#define COLOR_IMAGE		0xff55ff
+
+screen_cell_t screen[SCREEN_MAX_ROWS][SCREEN_MAX_COLS];
+
+static void put_text(int row, int* col, int cols, const char* text,
+		     uint32_t color)
+{
+	for (; *text && *col < cols; text++, (*col)++) {
+		screen[row][*col].ch = (unsigned char)*text;
+		screen[row][*col].front_color = color;
+	}
+}
+
+static void fill_row(int row, int cols)
+{
+	static const char name_chars[] =
+		"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+	static const uint32_t name_colors[] = {
+		COLOR_TEXT, COLOR_DIR, COLOR_EXEC, COLOR_LINK, COLOR_ARCHIVE,
+		COLOR_IMAGE,
+	};
+	static const char* months[] = { "Jan", "Mar", "Jun", "Oct", "Dec" };
+	int kind = rand() % ARRAY_SIZE(name_colors);
+	int name_len = 4 + rand() % 20;
+	char line[128];
+	int col = 0;
+
+	memset(screen[row], 0, sizeof(screen[row]));
+	snprintf(line, sizeof(line),
+		 "%s %2d root root %8d %s %2d %02d:%02d ",
+		 kind == 1 ? "drwxr-xr-x" : kind == 2 ? "-rwxr-xr-x" :
+		 kind == 3 ? "lrwxrwxrwx" : "-rw-r--r--",
+		 1 + rand() % 12, rand() % 10000000,
+		 months[rand() % ARRAY_SIZE(months)], 1 + rand() % 28,
+		 rand() % 24, rand() % 60);
+	put_text(row, &col, cols, line, COLOR_TEXT);
+	for (int i = 0; i < name_len; i++)
+		line[i] = name_chars[rand() % (sizeof(name_chars) - 1)];
+	line[name_len] = '\0';
+	put_text(row, &col, cols, line, name_colors[kind]);
+}
+
+/* The same contents for every call with the same size. */
+void screen_fill(int cols, int rows)
+{
+	memset(screen, 0, sizeof(screen));
+	srand(1);
+	for (int row = 0; row < rows; row++)
+		fill_row(row, cols);
+}
+
+static void draw_span(uint32_t* dst, int32_t pitch, int x, int y,
+		      const uint32_t* chars, int count, bool blank,
+		      uint32_t front_color)
+{
+	if (blank)
+		font_fill_span(dst, x, y, pitch, count, COLOR_BACK);
+	else
+		font_render_span(dst, x, y, pitch, chars, count,
+				 front_color, COLOR_BACK);
+}
+
+/*
+ * Draw rows |first| to |last| - 1 one cell at a time, like
+ * term_draw_cell() used to.
+ */
+void screen_draw_cells(uint32_t* dst, int32_t pitch, int cols, int first,
+		       int last)
+{
+	for (int row = first; row < last; row++) {
+		for (int col = 0; col < cols; col++) {
+			screen_cell_t* cell = &screen[row][col];
+
+			draw_span(dst, pitch, col, row, &cell->ch, 1,
+				  !cell->ch || cell->ch == ' ',
+				  cell->front_color);
+		}
+	}
+}
+
+/*
+ * Draw rows |first| to |last| - 1 in spans of same-colored cells, the way
+ * term_draw_cell() collects them.
+ */
+void screen_draw(uint32_t* dst, int32_t pitch, int cols, int first, int last)
+{
+	uint32_t chars[SPAN_MAX];
+
+	for (int row = first; row < last; row++) {
+		uint32_t front_color = 0;
+		bool blank = false;
+		int x = 0, count = 0;
+
+		for (int col = 0; col < cols; col++) {
+			screen_cell_t* cell = &screen[row][col];
+			bool cell_blank = !cell->ch || cell->ch == ' ';
+
+			if (count == SPAN_MAX || cell_blank != blank ||
+			    (!blank && cell->front_color != front_color)) {
+				if (count)
+					draw_span(dst, pitch, x, row, chars,
+						  count, blank, front_color);
+				x = col;
+				count = 0;
+				blank = cell_blank;
+				front_color = cell->front_color;
+			}
+			chars[count++] = cell->ch;
+		}
+		draw_span(dst, pitch, x, row, chars, count, blank,
+			  front_color);
+	}
+}
+
+double screen_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright 2016 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef BENCH_SCREEN_H
+#define BENCH_SCREEN_H
+
+#include <stdint.h>
+
+/* A 4K screen, the grid is sized for the built-in 8x16 font. */
+#define SCREEN_WIDTH		3840
+#define SCREEN_HEIGHT		2160
+#define SCREEN_MAX_COLS		(SCREEN_WIDTH / 8)
+#define SCREEN_MAX_ROWS		(SCREEN_HEIGHT / 16)
+
+#define COLOR_BACK		0x000000
+#define COLOR_TEXT		0xaaaaaa
+
+typedef struct {
+	uint32_t ch;
+	uint32_t front_color;
+} screen_cell_t;
+
+extern screen_cell_t screen[SCREEN_MAX_ROWS][SCREEN_MAX_COLS];
+
+void screen_fill(int cols, int rows);
+void screen_draw_cells(uint32_t* dst, int32_t pitch, int cols, int first,
+		       int last);
+void screen_draw(uint32_t* dst, int32_t pitch, int cols, int first, int last);
+double screen_now_ms(void);
+
+#endif
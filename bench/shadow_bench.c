@@ -0,0 +1,183 @@
+/*
+ * Copyright 2016 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Times terminal updates of a 3840x2160 screen drawn directly into the
+ * buffer that is shown, against drawing into a shadow buffer and copying
+ * the damage over as fb_upload_shadow() does. The copy is timed with
+ * memcpy and with the non-temporal stores of fb_copy_row().
+ *
+ * The shown buffer here is ordinary cached memory. A dumb buffer is
+ * usually mapped write-combined, where the direct path gets slower and
+ * reads from it are much slower, so these numbers are the best case for
+ * drawing directly.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "screen.h"
+#include "../font.h"
+
+#define PITCH (SCREEN_WIDTH * 4)
+#define RUNS 30
+
+typedef void (*copy_row_t)(uint32_t* dst, const uint32_t* src, int32_t count);
+
+static uint32_t* front;
+static uint32_t* shadow;
+static int cols, rows, row_height;
+
+static void copy_row_memcpy(uint32_t* dst, const uint32_t* src, int32_t count)
+{
+	memcpy(dst, src, count * sizeof(uint32_t));
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* The same stores as fb_copy_row() in fb.c. */
+__attribute__((target("sse2")))
+static void copy_row_stream(uint32_t* dst, const uint32_t* src, int32_t count)
+{
+	while (count > 0 && ((uintptr_t)dst & 15)) {
+		*dst++ = *src++;
+		count--;
+	}
+
+	for (; count >= 16; count -= 16, dst += 16, src += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)src);
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + 4));
+		__m128i c = _mm_loadu_si128((const __m128i*)(src + 8));
+		__m128i d = _mm_loadu_si128((const __m128i*)(src + 12));
+		_mm_stream_si128((__m128i*)dst, a);
+		_mm_stream_si128((__m128i*)(dst + 4), b);
+		_mm_stream_si128((__m128i*)(dst + 8), c);
+		_mm_stream_si128((__m128i*)(dst + 12), d);
+	}
+
+	for (; count >= 4; count -= 4, dst += 4, src += 4)
+		_mm_stream_si128((__m128i*)dst,
+				 _mm_loadu_si128((const __m128i*)src));
+
+	while (count-- > 0)
+		*dst++ = *src++;
+	_mm_sfence();
+}
+#endif
+
+/* Copy the text rows |first| to |last| - 1 from the shadow buffer. */
+static void upload(copy_row_t copy_row, int first, int last)
+{
+	size_t offset = (size_t)first * row_height * (PITCH / 4);
+
+	for (int y = first * row_height; y < last * row_height; y++) {
+		copy_row(front + offset, shadow + offset, SCREEN_WIDTH);
+		offset += PITCH / 4;
+	}
+}
+
+/* Output reached the bottom line and the screen scrolled by one line. */
+static void scroll_shadow(void)
+{
+	size_t line = (size_t)row_height * PITCH;
+
+	memmove(shadow, (char*)shadow + line, (rows - 1) * line);
+}
+
+/*
+ * Runs one update, |copy_row| is NULL for drawing directly. |what| is
+ * 0 for a full redraw, 1 for drawing the bottom line and 2 for scrolling
+ * by one line, which is a full redraw without a shadow buffer.
+ */
+static void update(int what, copy_row_t copy_row)
+{
+	if (!copy_row) {
+		if (what == 1)
+			screen_draw(front, PITCH, cols, rows - 1, rows);
+		else
+			screen_draw(front, PITCH, cols, 0, rows);
+		return;
+	}
+
+	switch (what) {
+	case 0:
+		screen_draw(shadow, PITCH, cols, 0, rows);
+		upload(copy_row, 0, rows);
+		break;
+	case 1:
+		screen_draw(shadow, PITCH, cols, rows - 1, rows);
+		upload(copy_row, rows - 1, rows);
+		break;
+	case 2:
+		scroll_shadow();
+		screen_draw(shadow, PITCH, cols, rows - 1, rows);
+		upload(copy_row, 0, rows);
+		break;
+	}
+}
+
+/* Returns the best update time in ms after a first update. */
+static double time_update(int what, copy_row_t copy_row)
+{
+	double best = 0;
+
+	update(what, copy_row);
+	for (int i = 0; i < RUNS; i++) {
+		double start = screen_now_ms();
+		double ms;
+
+		update(what, copy_row);
+		ms = screen_now_ms() - start;
+		if (i == 0 || ms < best)
+			best = ms;
+	}
+
+	return best;
+}
+
+int main(void)
+{
+	static const char* names[] = { "redraw", "line", "scroll" };
+	size_t size = (size_t)PITCH * SCREEN_HEIGHT;
+
+	if (posix_memalign((void**)&front, 64, size) ||
+	    posix_memalign((void**)&shadow, 64, size))
+		return 1;
+	memset(front, 1, size);
+	memset(shadow, 1, size);
+
+	printf("scale  %-8s %10s %10s %10s\n", "update", "direct", "memcpy",
+	       "stream");
+	for (int scaling = 1; scaling <= 4; scaling += 3) {
+		uint32_t char_width, char_height;
+
+		font_init(scaling);
+		font_get_size(&char_width, &char_height);
+		row_height = char_height;
+		cols = SCREEN_WIDTH / char_width;
+		rows = SCREEN_HEIGHT / row_height;
+		screen_fill(cols, rows);
+
+		for (int what = 0; what < 3; what++) {
+			printf("%d      %-8s", scaling, names[what]);
+			printf(" %7.3f ms", time_update(what, NULL));
+			printf(" %7.3f ms", time_update(what, copy_row_memcpy));
+#if defined(__x86_64__) || defined(__i386__)
+			printf(" %7.3f ms", time_update(what, copy_row_stream));
+#endif
+			printf("\n");
+		}
+		font_free();
+	}
+
+	free(shadow);
+	free(front);
+	return 0;
+}
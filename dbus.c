@@ -7,10 +7,13 @@
 #if DBUS
 #include <dbus/dbus.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #include "dbus.h"
 #include "dbus_interface.h"
+#include "event.h"
 #include "image.h"
 #include "main.h"
 #include "term.h"
@@ -19,6 +22,9 @@
 #define DBUS_WAIT_DELAY_US             (50000)
 #define DBUS_DEFAULT_DELAY             3000
 #define DBUS_INIT_TIMEOUT_MS           (60*1000)
+#define DBUS_MAX_WATCHES               4
+/* powerd only needs to hear about continuous activity this often. */
+#define DBUS_USER_ACTIVITY_INTERVAL_MS (5*1000)
 
 typedef struct _dbus_t dbus_t;
 
@@ -31,13 +37,34 @@ static bool dbus_connect_fail = false;
 static int64_t dbus_connect_fail_time;
 static bool dbus_first_init = true;
 static int64_t dbus_first_init_time;
+static int last_user_activity_type = -1;
+static int64_t last_user_activity_time;
 
+/*
+ * The read and write watches of the connection share its socket, which is
+ * registered with the event loop once for the union of the enabled ones.
+ */
 struct _dbus_t {
 	DBusConnection* conn;
-	DBusWatch* watch;
+	DBusWatch* watches[DBUS_MAX_WATCHES];
 	int fd;
+	event_source_t* source;
 };
 
+/* Reply handling of a method call sent by dbus_method_call_async(). */
+typedef struct {
+	const char* method;
+	dbus_reply_callback_t callback;
+	void* userptr;
+} dbus_pending_t;
+
+/* A DBusTimeout backed by a timerfd in the event loop. */
+typedef struct {
+	DBusTimeout* timeout;
+	int fd;
+	event_source_t* source;
+} dbus_timer_t;
+
 static dbus_t *dbus = NULL;
 
 static void frecon_dbus_unregister(DBusConnection* connection, void* user_data)
@@ -58,20 +85,163 @@ frecon_vtable = {
 	NULL
 };
 
+static void dbus_watch_event(uint32_t events, void* data)
+{
+	dbus_t* dbus = (dbus_t*)data;
+	DBusWatch* watches[DBUS_MAX_WATCHES];
+	unsigned int ready = 0;
+
+	if (events & EPOLLIN)
+		ready |= DBUS_WATCH_READABLE;
+	if (events & EPOLLOUT)
+		ready |= DBUS_WATCH_WRITABLE;
+	if (events & EPOLLERR)
+		ready |= DBUS_WATCH_ERROR;
+	if (events & EPOLLHUP)
+		ready |= DBUS_WATCH_HANGUP;
+
+	/* Handling a watch may add, remove or toggle the others. */
+	memcpy(watches, dbus->watches, sizeof(watches));
+	for (int i = 0; i < DBUS_MAX_WATCHES; i++) {
+		DBusWatch* w = watches[i];
+		unsigned int flags;
+
+		if (!w || dbus->watches[i] != w || !dbus_watch_get_enabled(w))
+			continue;
+
+		flags = ready & (dbus_watch_get_flags(w) |
+				 DBUS_WATCH_ERROR | DBUS_WATCH_HANGUP);
+		if (flags)
+			dbus_watch_handle(w, flags);
+	}
+
+	dbus_dispatch_io();
+}
+
+static void dbus_update_watches(dbus_t* dbus)
+{
+	uint32_t events = 0;
+
+	for (int i = 0; i < DBUS_MAX_WATCHES; i++) {
+		DBusWatch* w = dbus->watches[i];
+		unsigned int flags;
+
+		if (!w || !dbus_watch_get_enabled(w))
+			continue;
+
+		flags = dbus_watch_get_flags(w);
+		if (flags & DBUS_WATCH_READABLE)
+			events |= EPOLLIN;
+		if (flags & DBUS_WATCH_WRITABLE)
+			events |= EPOLLOUT;
+	}
+
+	if (dbus->source)
+		event_modify(dbus->source, events);
+	else if (dbus->fd >= 0)
+		dbus->source = event_add(dbus->fd, events,
+					 dbus_watch_event, dbus);
+}
+
 static dbus_bool_t add_watch(DBusWatch* w, void* data)
 {
 	dbus_t* dbus = (dbus_t*)data;
-	dbus->watch = w;
 
-	return TRUE;
+	for (int i = 0; i < DBUS_MAX_WATCHES; i++) {
+		if (!dbus->watches[i]) {
+			dbus->watches[i] = w;
+			if (dbus->fd < 0)
+				dbus->fd = dbus_watch_get_unix_fd(w);
+			dbus_update_watches(dbus);
+			return TRUE;
+		}
+	}
+
+	LOG(ERROR, "Too many dbus watches");
+	return FALSE;
 }
 
 static void remove_watch(DBusWatch* w, void* data)
 {
+	dbus_t* dbus = (dbus_t*)data;
+
+	for (int i = 0; i < DBUS_MAX_WATCHES; i++)
+		if (dbus->watches[i] == w)
+			dbus->watches[i] = NULL;
+	dbus_update_watches(dbus);
 }
 
 static void toggle_watch(DBusWatch* w, void* data)
 {
+	dbus_update_watches((dbus_t*)data);
+}
+
+static void dbus_timeout_event(uint32_t events, void* data)
+{
+	dbus_timer_t* timer = (dbus_timer_t*)data;
+	uint64_t expirations;
+
+	if (read(timer->fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	dbus_timeout_handle(timer->timeout);
+	dbus_dispatch_io();
+}
+
+static void toggle_timeout(DBusTimeout* t, void* data)
+{
+	dbus_timer_t* timer = dbus_timeout_get_data(t);
+	struct itimerspec spec;
+
+	memset(&spec, 0, sizeof(spec));
+	if (dbus_timeout_get_enabled(t)) {
+		int interval = dbus_timeout_get_interval(t);
+
+		spec.it_value.tv_sec = interval / MS_PER_SEC;
+		spec.it_value.tv_nsec = (interval % MS_PER_SEC) * NS_PER_MS;
+		spec.it_interval = spec.it_value;
+	}
+	timerfd_settime(timer->fd, 0, &spec, NULL);
+}
+
+static dbus_bool_t add_timeout(DBusTimeout* t, void* data)
+{
+	dbus_timer_t* timer;
+
+	timer = (dbus_timer_t*)calloc(1, sizeof(*timer));
+	if (!timer)
+		return FALSE;
+
+	timer->timeout = t;
+	timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer->fd < 0) {
+		free(timer);
+		return FALSE;
+	}
+
+	timer->source = event_add(timer->fd, EPOLLIN, dbus_timeout_event, timer);
+	if (!timer->source) {
+		close(timer->fd);
+		free(timer);
+		return FALSE;
+	}
+
+	dbus_timeout_set_data(t, timer, NULL);
+	toggle_timeout(t, data);
+	return TRUE;
+}
+
+static void remove_timeout(DBusTimeout* t, void* data)
+{
+	dbus_timer_t* timer = dbus_timeout_get_data(t);
+
+	if (!timer)
+		return;
+
+	dbus_timeout_set_data(t, NULL, NULL);
+	event_remove(timer->source);
+	close(timer->fd);
+	free(timer);
 }
 
 static DBusHandlerResult handle_login_prompt_visible(DBusMessage* message)
@@ -181,6 +351,14 @@ bool dbus_init()
 		LOG(ERROR, "Failed to set watch functions");
 	}
 
+	stat = dbus_connection_set_timeout_functions(new_dbus->conn,
+			add_timeout, remove_timeout, toggle_timeout,
+			new_dbus, NULL);
+
+	if (!stat) {
+		LOG(ERROR, "Failed to set timeout functions");
+	}
+
 	dbus_connection_set_exit_on_disconnect(new_dbus->conn, FALSE);
 
 	dbus = new_dbus;
@@ -202,41 +380,46 @@ bool dbus_init_wait()
 	return true;
 }
 
-static bool dbus_method_call0(const char* service_name,
-			      const char* service_path,
-			      const char* service_interface,
-			      const char* method)
+static void dbus_method_call_notify(DBusPendingCall* pending, void* user_data)
 {
-	DBusMessage* msg = NULL;
-	if (!dbus) {
-		LOG(ERROR, "dbus not initialized");
-		return false;
-	}
+	dbus_pending_t* call = (dbus_pending_t*)user_data;
+	DBusMessage* reply = dbus_pending_call_steal_reply(pending);
+	bool success = false;
 
-	msg = dbus_message_new_method_call(service_name,
-			service_path, service_interface, method);
-
-	if (!msg)
-		return false;
-
-	if (!dbus_connection_send_with_reply_and_block(dbus->conn,
-				msg, DBUS_DEFAULT_DELAY, NULL)) {
-		dbus_message_unref(msg);
-		return false;
+	if (reply) {
+		if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR)
+			LOG(WARNING, "%s failed: %s", call->method,
+			    dbus_message_get_error_name(reply));
+		else
+			success = true;
+		dbus_message_unref(reply);
 	}
+	dbus_pending_call_unref(pending);
 
-	dbus_connection_flush(dbus->conn);
-	dbus_message_unref(msg);
-
-	return true;
+	if (call->callback)
+		call->callback(success, call->userptr);
 }
 
-static bool dbus_method_call1(const char* service_name,
-			      const char* service_path,
-			      const char* service_interface,
-			      const char* method, int arg_type, void* param)
+/*
+ * Send a method call without waiting for it. With |want_reply| the reply
+ * (or the timeout) is handled from the event loop when it arrives: errors
+ * are logged and |callback|, if any, is told whether the call succeeded.
+ * Otherwise the callee is told not to send a reply at all. |arg_type| may
+ * be DBUS_TYPE_INVALID for calls without an argument.
+ */
+static bool dbus_method_call_async(const char* service_name,
+				   const char* service_path,
+				   const char* service_interface,
+				   const char* method, bool want_reply,
+				   dbus_reply_callback_t callback,
+				   void* userptr,
+				   int arg_type, void* param)
 {
 	DBusMessage* msg = NULL;
+	DBusPendingCall* pending = NULL;
+	dbus_pending_t* call;
+	bool ret;
+
 	if (!dbus) {
 		LOG(ERROR, "dbus not initialized");
 		return false;
@@ -248,22 +431,42 @@ static bool dbus_method_call1(const char* service_name,
 	if (!msg)
 		return false;
 
-	if (!dbus_message_append_args(msg,
+	if (arg_type != DBUS_TYPE_INVALID &&
+	    !dbus_message_append_args(msg,
 				arg_type, param, DBUS_TYPE_INVALID)) {
 		dbus_message_unref(msg);
 		return false;
 	}
 
-	if (!dbus_connection_send_with_reply_and_block(dbus->conn,
-				msg, DBUS_DEFAULT_DELAY, NULL)) {
-		dbus_message_unref(msg);
-		return false;
+	if (want_reply) {
+		call = (dbus_pending_t*)calloc(1, sizeof(*call));
+		if (!call) {
+			dbus_message_unref(msg);
+			return false;
+		}
+		call->method = method;
+		call->callback = callback;
+		call->userptr = userptr;
+
+		ret = dbus_connection_send_with_reply(dbus->conn, msg,
+				&pending, DBUS_DEFAULT_DELAY) && pending;
+		if (ret && !dbus_pending_call_set_notify(pending,
+				dbus_method_call_notify, call, free)) {
+			/* The free notifier was not installed. */
+			dbus_pending_call_cancel(pending);
+			dbus_pending_call_unref(pending);
+			free(call);
+			ret = false;
+		} else if (!ret) {
+			free(call);
+		}
+	} else {
+		dbus_message_set_no_reply(msg, TRUE);
+		ret = dbus_connection_send(dbus->conn, msg, NULL);
 	}
 
-	dbus_connection_flush(dbus->conn);
 	dbus_message_unref(msg);
-
-	return true;
+	return ret;
 }
 
 void dbus_destroy(void)
@@ -275,58 +478,62 @@ void dbus_destroy(void)
 	 */
 	/* dbus_connection_unref(dbus->conn); */
 	if (dbus) {
+		event_remove(dbus->source);
 		free(dbus);
 		dbus = NULL;
 	}
 }
 
-void dbus_add_fds(fd_set* read_set, fd_set* exception_set, int *maxfd)
-{
-	if (!dbus)
-		return;
-
-	if (dbus->fd < 0)
-		dbus->fd = dbus_watch_get_unix_fd(dbus->watch);
-
-	if (dbus->fd >= 0) {
-		FD_SET(dbus->fd, read_set);
-		FD_SET(dbus->fd, exception_set);
-	}
-
-	if (dbus->fd > *maxfd)
-		*maxfd = dbus->fd;
-}
-
+/*
+ * Dispatch messages that are already queued on the connection. Replies to
+ * blocking method calls can queue up signals without the socket becoming
+ * readable again, so this also runs after every event loop iteration.
+ */
 void dbus_dispatch_io(void)
 {
 	if (!dbus)
 		return;
 
-	dbus_watch_handle(dbus->watch, DBUS_WATCH_READABLE);
 	while (dbus_connection_get_dispatch_status(dbus->conn)
 			== DBUS_DISPATCH_DATA_REMAINS) {
 		dbus_connection_dispatch(dbus->conn);
 	}
 }
 
+/*
+ * Nothing here waits for powerd. Repeated reports of the same activity,
+ * e.g. from typing or key auto-repeat, are coalesced and sent at most once
+ * per DBUS_USER_ACTIVITY_INTERVAL_MS.
+ */
 void dbus_report_user_activity(int activity_type)
 {
 	dbus_bool_t allow_off = false;
+	int64_t now;
+
 	if (!dbus)
 		return;
 
-	dbus_method_call1(kPowerManagerServiceName,
-			kPowerManagerServicePath,
-			kPowerManagerInterface,
-			kHandleUserActivityMethod,
-			DBUS_TYPE_INT32, &activity_type);
+	now = get_monotonic_time_ms();
+	if (activity_type != last_user_activity_type ||
+	    now - last_user_activity_time >= DBUS_USER_ACTIVITY_INTERVAL_MS) {
+		if (dbus_method_call_async(kPowerManagerServiceName,
+				kPowerManagerServicePath,
+				kPowerManagerInterface,
+				kHandleUserActivityMethod, false, NULL, NULL,
+				DBUS_TYPE_INT32, &activity_type)) {
+			last_user_activity_type = activity_type;
+			last_user_activity_time = now;
+		}
+	}
 
 	switch (activity_type) {
 		case USER_ACTIVITY_BRIGHTNESS_UP_KEY_PRESS:
-				(void)dbus_method_call0(kPowerManagerServiceName,
+				(void)dbus_method_call_async(kPowerManagerServiceName,
 					kPowerManagerServicePath,
 					kPowerManagerInterface,
-					kIncreaseScreenBrightnessMethod);
+					kIncreaseScreenBrightnessMethod, true,
+					NULL, NULL,
+					DBUS_TYPE_INVALID, NULL);
 				break;
 		case USER_ACTIVITY_BRIGHTNESS_DOWN_KEY_PRESS:
 				/*
@@ -334,10 +541,11 @@ void dbus_report_user_activity(int activity_type)
 				 * completely off while frecon is active
 				 * so passing false to allow_off
 				 */
-				(void)dbus_method_call1(kPowerManagerServiceName,
+				(void)dbus_method_call_async(kPowerManagerServiceName,
 					kPowerManagerServicePath,
 					kPowerManagerInterface,
-					kDecreaseScreenBrightnessMethod,
+					kDecreaseScreenBrightnessMethod, true,
+					NULL, NULL,
 					DBUS_TYPE_BOOLEAN, &allow_off);
 				break;
 	}
@@ -350,23 +558,31 @@ void dbus_take_display_ownership(void)
 {
 	if (!dbus)
 		return;
-	(void)dbus_method_call0(kLibCrosServiceName,
-				kLibCrosServicePath,
-				kLibCrosServiceInterface,
-				kTakeDisplayOwnership);
+	(void)dbus_method_call_async(kLibCrosServiceName,
+				     kLibCrosServicePath,
+				     kLibCrosServiceInterface,
+				     kTakeDisplayOwnership, true, NULL, NULL,
+				     DBUS_TYPE_INVALID, NULL);
 }
 
 /*
- * ask Chrome to give up display ownership (DRM master)
+ * ask Chrome to give up display ownership (DRM master), |callback| is
+ * called from the event loop once Chrome replied or the call timed out.
+ * Returns false, without calling |callback|, if the call was not sent.
  */
-bool dbus_release_display_ownership(void)
+bool dbus_release_display_ownership(dbus_reply_callback_t callback,
+				    void* userptr)
 {
-	if (!dbus)
+	if (!dbus) {
+		callback(true, userptr);
 		return true;
-	return dbus_method_call0(kLibCrosServiceName,
-				 kLibCrosServicePath,
-				 kLibCrosServiceInterface,
-				 kReleaseDisplayOwnership);
+	}
+	return dbus_method_call_async(kLibCrosServiceName,
+				      kLibCrosServicePath,
+				      kLibCrosServiceInterface,
+				      kReleaseDisplayOwnership, true,
+				      callback, userptr,
+				      DBUS_TYPE_INVALID, NULL);
 }
 
 void dbus_set_login_prompt_visible_callback(void (*callback)(void*),
@@ -415,10 +631,6 @@ void dbus_destroy(void)
 {
 }
 
-void dbus_add_fds(fd_set* read_set, fd_set* exception_set, int *maxfd)
-{
-}
-
 void dbus_dispatch_io(void)
 {
 }
@@ -431,8 +643,10 @@ void dbus_take_display_ownership(void)
 {
 }
 
-bool dbus_release_display_ownership(void)
+bool dbus_release_display_ownership(dbus_reply_callback_t callback,
+				    void* userptr)
 {
+	callback(true, userptr);
 	return true;
 }
 
@@ -31,14 +31,14 @@ enum UserActivityType {
 };
 
 static const char kSuspendDoneSignal[] = "SuspendDone";
-static const char kSuspendDoneRule[] = "interface='org.chromium.PowerManager',type='signal'";
+static const char kSuspendDoneRule[] = "type='signal',sender='org.chromium.PowerManager',path='/org/chromium/PowerManager',interface='org.chromium.PowerManager',member='SuspendDone'";
 
 static const char kSessionManagerInterface[] = "org.chromium.SessionManagerInterface";
 static const char kSessionManagerServicePath[] = "/org/chromium/SessionManager";
 static const char kSessionManagerServiceName[] = "org.chromium.SessionManager";
 
 static const char kLoginPromptVisibleSignal[] = "LoginPromptVisible";
-static const char kLoginPromptVisibleRule[] = "interface='org.chromium.SessionManagerInterface',type='signal'";
+static const char kLoginPromptVisibleRule[] = "type='signal',sender='org.chromium.SessionManager',path='/org/chromium/SessionManager',interface='org.chromium.SessionManagerInterface',member='LoginPromptVisible'";
 
 static const char kLibCrosServiceName[] = "org.chromium.LibCrosService";
 static const char kLibCrosServicePath[] = "/org/chromium/LibCrosService";
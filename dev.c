@@ -9,6 +9,7 @@
 #include <string.h>
 
 #include "dev.h"
+#include "event.h"
 #include "input.h"
 #include "term.h"
 #include "util.h"
@@ -16,6 +17,9 @@
 static struct udev* udev = NULL;
 static struct udev_monitor* udev_monitor = NULL;
 static int udev_fd = -1;
+static event_source_t* udev_source = NULL;
+
+static void dev_event(uint32_t events, void* data);
 
 int dev_init(void)
 {
@@ -35,6 +39,7 @@ int dev_init(void)
 							"drm_minor");
 	udev_monitor_enable_receiving(udev_monitor);
 	udev_fd = udev_monitor_get_fd(udev_monitor);
+	udev_source = event_add(udev_fd, EPOLLIN, dev_event, NULL);
 
 	dev_add_existing_input_devs();
 
@@ -46,6 +51,8 @@ void dev_close(void)
 	if (!udev_monitor) {
 		return;
 	}
+	event_remove(udev_source);
+	udev_source = NULL;
 	udev_monitor_unref(udev_monitor);
 	udev_monitor = NULL;
 	udev_unref(udev);
@@ -72,24 +79,17 @@ void dev_add_existing_input_devs(void)
 	udev_enumerate_unref(udev_enum);
 }
 
-void dev_add_fds(fd_set* read_set, fd_set* exception_set, int *maxfd)
-{
-	FD_SET(udev_fd, read_set);
-	FD_SET(udev_fd, exception_set);
-	if (udev_fd > *maxfd)
-		*maxfd = udev_fd;
-}
-
-void dev_dispatch_io(fd_set* read_set, fd_set* exception_set)
+static void dev_event(uint32_t events, void* data)
 {
-	if (FD_ISSET(udev_fd, exception_set)) {
+	if (events & EPOLLERR) {
 		/* udev died on us? */
 		LOG(ERROR, "Exception on udev fd");
+		event_remove(udev_source);
+		udev_source = NULL;
 		return;
 	}
 
-	if (FD_ISSET(udev_fd, read_set)
-	    && !FD_ISSET(udev_fd, exception_set)) {
+	if (events & EPOLLIN) {
 		/* we got an udev notification */
 		struct udev_device* dev =
 		    udev_monitor_receive_device(udev_monitor);
@@ -10,7 +10,5 @@
 int dev_init(void);
 void dev_close(void);
 void dev_add_existing_input_devs(void);
-void dev_add_fds(fd_set* read_set, fd_set* exception_set, int *maxfd);
-void dev_dispatch_io(fd_set* read_set, fd_set* exception_set);
 
 #endif
@@ -6,8 +6,10 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -227,6 +229,11 @@ static void drm_fini(drm_t* drm)
 		return;
 
 	if (drm->fd >= 0) {
+		if (drm->source) {
+			event_remove(drm->source);
+			drm->source = NULL;
+		}
+
 		if (drm->crtc) {
 			drmModeFreeCrtc(drm->crtc);
 			drm->crtc = NULL;
@@ -498,7 +505,21 @@ bool drm_valid(drm_t* drm) {
 	return drm && drm->fd >= 0 && drm->resources && drm->main_monitor_connector && drm->crtc;
 }
 
-int32_t drm_setmode(drm_t* drm, uint32_t fb_id)
+static void drm_complete_flip(drm_t* drm)
+{
+	drm_page_flip_handler_t handler = drm->flip_handler;
+
+	drm->flip_pending = false;
+	drm->flip_handler = NULL;
+	if (handler)
+		handler(drm->flip_data);
+}
+
+/*
+ * A blocking mode set also waits for a pending flip, so it completes a flip
+ * that drm_wait_page_flip() gave up on. Its late event is then ignored.
+ */
+static int32_t drm_set_crtc(drm_t* drm, uint32_t fb_id)
 {
 	int32_t ret;
 
@@ -515,6 +536,19 @@ int32_t drm_setmode(drm_t* drm, uint32_t fb_id)
 		LOG(ERROR, "Unable to set crtc: %m");
 		return ret;
 	}
+	drm->scanout_fb_id = fb_id;
+	if (drm->flip_pending)
+		drm_complete_flip(drm);
+	return 0;
+}
+
+int32_t drm_setmode(drm_t* drm, uint32_t fb_id)
+{
+	int32_t ret;
+
+	ret = drm_set_crtc(drm, fb_id);
+	if (ret)
+		return ret;
 
 	ret = drmModeSetCursor(drm->fd, drm->crtc->crtc_id,
 			0, 0, 0);
@@ -526,6 +560,150 @@ int32_t drm_setmode(drm_t* drm, uint32_t fb_id)
 	return ret;
 }
 
+bool drm_is_scanout(drm_t* drm, uint32_t fb_id)
+{
+	return drm_valid(drm) && drm->scanout_fb_id == fb_id;
+}
+
+/* The drm whose events drm_handle_events() is dispatching. */
+static drm_t* event_drm = NULL;
+
+/*
+ * Each flip carries its sequence number. Events of flips that were already
+ * completed by drm_wait_page_flip() must not complete the next one.
+ */
+static void drm_page_flip_handler(int fd, unsigned int frame,
+				  unsigned int sec, unsigned int usec,
+				  void* data)
+{
+	drm_t* drm = event_drm;
+
+	if (!drm->flip_pending || (uintptr_t)data != drm->flip_seq) {
+		LOG(INFO, "Ignoring stale page flip event.");
+		return;
+	}
+
+	drm_complete_flip(drm);
+}
+
+static void drm_handle_events(drm_t* drm)
+{
+	drmEventContext ctx;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.version = 2;
+	ctx.page_flip_handler = drm_page_flip_handler;
+	event_drm = drm;
+	drmHandleEvent(drm->fd, &ctx);
+	event_drm = NULL;
+}
+
+static void drm_event(uint32_t events, void* data)
+{
+	drm_handle_events((drm_t*)data);
+}
+
+/*
+ * Queue a flip to |fb_id| on the next vblank. |handler| is called from
+ * the event loop once the flip has completed. Only one flip can be
+ * pending at a time.
+ */
+int32_t drm_page_flip(drm_t* drm, uint32_t fb_id,
+		      drm_page_flip_handler_t handler, void* data)
+{
+	int32_t ret;
+
+	if (!drm_valid(drm))
+		return -ENODEV;
+
+	if (drm->flip_pending)
+		return -EBUSY;
+
+	/* The fd only becomes readable for our own events. */
+	if (!drm->source) {
+		drm->source = event_add(drm->fd, EPOLLIN, drm_event, drm);
+		if (!drm->source)
+			return -ENOMEM;
+	}
+
+	ret = drmModePageFlip(drm->fd, drm->crtc->crtc_id, fb_id,
+			      DRM_MODE_PAGE_FLIP_EVENT,
+			      (void*)(uintptr_t)(drm->flip_seq + 1));
+	if (ret)
+		return ret;
+
+	drm->scanout_fb_id = fb_id;
+	drm->flip_pending = true;
+	drm->flip_seq++;
+	drm->flip_handler = handler;
+	drm->flip_data = data;
+	return 0;
+}
+
+/* Mode sets drm_wait_page_flip() tries before giving up on a flip. */
+#define DRM_FLIP_SETMODE_RETRIES 3
+
+/*
+ * Block until the pending flip completes. If it does not complete within
+ * |timeout_ms|, or the fd cannot be polled, the flipped fb is shown with a
+ * blocking mode set instead, which waits for the kernel to finish the
+ * flip. The late event is then ignored. If the mode set keeps failing (we
+ * are not master, say) this gives up after DRM_FLIP_SETMODE_RETRIES
+ * timeouts and returns with the flip still pending. It completes once its
+ * event arrives or the next mode set succeeds.
+ */
+void drm_wait_page_flip(drm_t* drm, int timeout_ms)
+{
+	int64_t deadline = get_monotonic_time_ms() + timeout_ms;
+	int retries = 0;
+
+	while (drm && drm->flip_pending) {
+		struct pollfd pfd = { drm->fd, POLLIN, 0 };
+		int64_t remaining = deadline - get_monotonic_time_ms();
+		int ret;
+
+		if (remaining > 0)
+			ret = poll(&pfd, 1, remaining);
+		else
+			ret = 0;
+
+		if (ret > 0) {
+			drm_handle_events(drm);
+			continue;
+		}
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret == 0)
+			LOG(WARNING, "Timed out waiting for page flip.");
+		else
+			LOG(ERROR, "poll on drm fd failed: %m");
+
+		if (!drm_set_crtc(drm, drm->scanout_fb_id)) {
+			continue;
+		} else if (ret < 0) {
+			/* Wait for the event in a blocking read. */
+			drm_handle_events(drm);
+		} else if (++retries >= DRM_FLIP_SETMODE_RETRIES) {
+			LOG(ERROR, "Giving up on waiting for page flip.");
+			return;
+		} else {
+			deadline = get_monotonic_time_ms() + timeout_ms;
+		}
+	}
+}
+
+/*
+ * Forget a pending flip, its event is then ignored. For when the fb it
+ * completes to goes away while drm_wait_page_flip() has given up on it.
+ */
+void drm_cancel_page_flip(drm_t* drm)
+{
+	drm->flip_pending = false;
+	drm->flip_handler = NULL;
+}
+
 bool drm_read_edid(drm_t* drm)
 {
 	if (drm->edid_found) {
@@ -14,6 +14,10 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include "event.h"
+
+typedef void (*drm_page_flip_handler_t)(void* data);
+
 typedef struct _drm_t {
 	int refcount;
 	int fd;
@@ -24,6 +28,12 @@ typedef struct _drm_t {
 	uint32_t selected_mode;
 	bool edid_found;
 	char edid[EDID_SIZE];
+	uint32_t scanout_fb_id;
+	bool flip_pending;
+	uint32_t flip_seq;
+	drm_page_flip_handler_t flip_handler;
+	void* flip_data;
+	event_source_t* source;
 } drm_t;
 
 drm_t* drm_scan(void);
@@ -36,6 +46,11 @@ int drm_setmaster(drm_t* drm);
 bool drm_rescan(void);
 bool drm_valid(drm_t* drm);
 int32_t drm_setmode(drm_t* drm, uint32_t fb_id);
+bool drm_is_scanout(drm_t* drm, uint32_t fb_id);
+int32_t drm_page_flip(drm_t* drm, uint32_t fb_id,
+		      drm_page_flip_handler_t handler, void* data);
+void drm_wait_page_flip(drm_t* drm, int timeout_ms);
+void drm_cancel_page_flip(drm_t* drm);
 bool drm_read_edid(drm_t* drm);
 uint32_t drm_gethres(drm_t* drm);
 uint32_t drm_getvres(drm_t* drm);
@@ -0,0 +1,198 @@
+/*
+ * Copyright 2016 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "util.h"
+
+#define EVENT_MAX_EVENTS  32
+#define EVENT_STATS_INTERVAL_MS  (60 * MS_PER_SEC)
+
+/*
+ * Every fd frecon waits on is registered once with a single epoll instance
+ * and stays there until its owner removes it, so waiting for events costs
+ * one epoll_wait() no matter how many sources there are.
+ */
+struct _event_source_t {
+	int fd;
+	event_cb_t cb;
+	void* data;
+	bool high_priority;
+	event_source_t* next_dead;
+};
+
+static int epoll_fd = -1;
+static int dispatch_depth = 0;
+/*
+ * Sources removed while events are being dispatched may still be referenced
+ * by the remaining entries of the batch, they are freed once it is done.
+ */
+static event_source_t* dead_sources = NULL;
+
+/*
+ * Wakeups are counted and their rate logged at most once per
+ * EVENT_STATS_INTERVAL_MS, from a wakeup so an idle frecon stays asleep.
+ */
+static unsigned int wakeups = 0;
+static int64_t wakeups_since_ms = 0;
+
+static void event_count_wakeup(void)
+{
+	int64_t now = get_monotonic_time_ms();
+	int64_t elapsed;
+
+	if (!wakeups_since_ms)
+		wakeups_since_ms = now;
+
+	wakeups++;
+	elapsed = now - wakeups_since_ms;
+	if (elapsed < EVENT_STATS_INTERVAL_MS)
+		return;
+
+	LOG(INFO, "%u wakeups in %lld s (%.2f per second)", wakeups,
+	    (long long)(elapsed / MS_PER_SEC),
+	    (double)wakeups * MS_PER_SEC / elapsed);
+	wakeups = 0;
+	wakeups_since_ms = now;
+}
+
+int event_init(void)
+{
+	if (epoll_fd >= 0)
+		return 0;
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		LOG(ERROR, "Failed to create epoll fd: %m");
+		return -errno;
+	}
+	return 0;
+}
+
+void event_close(void)
+{
+	if (epoll_fd < 0)
+		return;
+
+	close(epoll_fd);
+	epoll_fd = -1;
+}
+
+event_source_t* event_add(int fd, uint32_t events, event_cb_t cb, void* data)
+{
+	event_source_t* source;
+	struct epoll_event ev;
+
+	if (epoll_fd < 0 || fd < 0)
+		return NULL;
+
+	source = calloc(1, sizeof(*source));
+	if (!source)
+		return NULL;
+
+	source->fd = fd;
+	source->cb = cb;
+	source->data = data;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = source;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		LOG(ERROR, "Failed to add fd %d to event loop: %m", fd);
+		free(source);
+		return NULL;
+	}
+
+	return source;
+}
+
+int event_modify(event_source_t* source, uint32_t events)
+{
+	struct epoll_event ev;
+
+	if (!source || !source->cb)
+		return -EINVAL;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = source;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, source->fd, &ev) < 0)
+		return -errno;
+	return 0;
+}
+
+/*
+ * Must be called before the fd is closed. It is safe to remove any source,
+ * including the one being dispatched, from a callback.
+ */
+void event_remove(event_source_t* source)
+{
+	if (!source || !source->cb)
+		return;
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+	source->cb = NULL;
+
+	if (dispatch_depth) {
+		source->next_dead = dead_sources;
+		dead_sources = source;
+	} else {
+		free(source);
+	}
+}
+
+/*
+ * High priority sources, e.g. the keyboard, are dispatched before all other
+ * sources that became ready in the same wakeup.
+ */
+void event_set_priority(event_source_t* source, bool high)
+{
+	if (source)
+		source->high_priority = high;
+}
+
+/*
+ * Wait up to |timeout_ms| (-1 forever) and run the callbacks of all ready
+ * sources. Returns the number of sources that were ready or -errno.
+ */
+int event_dispatch(int timeout_ms)
+{
+	struct epoll_event events[EVENT_MAX_EVENTS];
+	int n;
+
+	n = epoll_wait(epoll_fd, events, EVENT_MAX_EVENTS, timeout_ms);
+	if (n < 0)
+		return errno == EINTR ? 0 : -errno;
+	if (n > 0)
+		event_count_wakeup();
+
+	dispatch_depth++;
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < n; i++) {
+			event_source_t* source = events[i].data.ptr;
+
+			if (source->high_priority != !pass)
+				continue;
+			if (source->cb)
+				source->cb(events[i].events, source->data);
+		}
+	}
+	dispatch_depth--;
+
+	if (!dispatch_depth) {
+		while (dead_sources) {
+			event_source_t* source = dead_sources;
+			dead_sources = source->next_dead;
+			free(source);
+		}
+	}
+
+	return n;
+}
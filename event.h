@@ -0,0 +1,27 @@
+/*
+ * Copyright 2016 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+typedef struct _event_source_t event_source_t;
+
+/* Called with the ready EPOLL* bits of the source. */
+typedef void (*event_cb_t)(uint32_t events, void* data);
+
+int event_init(void);
+void event_close(void);
+event_source_t* event_add(int fd, uint32_t events, event_cb_t cb, void* data);
+int event_modify(event_source_t* source, uint32_t events);
+void event_remove(event_source_t* source);
+void event_set_priority(event_source_t* source, bool high);
+int event_dispatch(int timeout_ms);
+
+#endif
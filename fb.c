@@ -9,18 +9,25 @@
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-#include "util.h"
 #include "fb.h"
+#include "main.h"
+#include "util.h"
 
-static int fb_buffer_create(fb_t* fb,
-			    int* pitch)
+#define FB_FLIP_TIMEOUT_MS 100
+#define FB_PAN_SCREENS 2
+
+static int fb_bo_create(fb_t* fb, fb_bo_t* bo, int32_t height, int* pitch)
 {
 	struct drm_mode_create_dumb create_dumb;
 	struct drm_mode_destroy_dumb destroy_dumb;
@@ -29,7 +36,7 @@ static int fb_buffer_create(fb_t* fb,
 	memset(&create_dumb, 0, sizeof (create_dumb));
 	create_dumb.bpp = 32;
 	create_dumb.width = fb->drm->crtc->mode.hdisplay;
-	create_dumb.height = fb->drm->crtc->mode.vdisplay;
+	create_dumb.height = height;
 
 	ret = drmIoctl(fb->drm->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_dumb);
 	if (ret) {
@@ -38,7 +45,7 @@ static int fb_buffer_create(fb_t* fb,
 	}
 
 	fb->buffer_properties.size = create_dumb.size;
-	fb->buffer_handle = create_dumb.handle;
+	bo->handle = create_dumb.handle;
 
 	struct drm_mode_map_dumb map_dumb;
 	map_dumb.handle = create_dumb.handle;
@@ -48,43 +55,281 @@ static int fb_buffer_create(fb_t* fb,
 		goto destroy_buffer;
 	}
 
-	fb->lock.map_offset = map_dumb.offset;
+	/* The mapping is kept until the buffer is destroyed. */
+	bo->map = mmap(0, create_dumb.size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED, fb->drm->fd, map_dumb.offset);
+	if (bo->map == MAP_FAILED) {
+		LOG(ERROR, "mmap failed");
+		bo->map = NULL;
+		ret = -errno;
+		goto destroy_buffer;
+	}
 
 	uint32_t offset = 0;
 	ret = drmModeAddFB2(fb->drm->fd, fb->drm->crtc->mode.hdisplay, fb->drm->crtc->mode.vdisplay,
 			    DRM_FORMAT_XRGB8888, &create_dumb.handle,
-			    &create_dumb.pitch, &offset, &fb->fb_id, 0);
+			    &create_dumb.pitch, &offset, &bo->fb_id, 0);
 	if (ret) {
 		LOG(ERROR, "drmModeAddFB2 failed");
-		goto destroy_buffer;
+		goto unmap_buffer;
 	}
 
 	*pitch = create_dumb.pitch;
 
 	return 0;
 
+unmap_buffer:
+	munmap(bo->map, create_dumb.size);
+	bo->map = NULL;
 destroy_buffer:
 	destroy_dumb.handle = create_dumb.handle;
 
 	drmIoctl(fb->drm->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_dumb);
+	bo->handle = 0;
 
 	return ret;
 }
 
-void fb_buffer_destroy(fb_t* fb)
+static void fb_bo_destroy(fb_t* fb, fb_bo_t* bo)
 {
 	struct drm_mode_destroy_dumb destroy_dumb;
 
-	if (fb->buffer_handle <= 0)
+	if (bo->map)
+		munmap(bo->map, fb->buffer_properties.size);
+	drmModeRmFB(fb->drm->fd, bo->fb_id);
+	destroy_dumb.handle = bo->handle;
+	drmIoctl(fb->drm->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_dumb);
+	memset(bo, 0, sizeof(*bo));
+}
+
+static int fb_buffer_create(fb_t* fb,
+			    int* pitch)
+{
+	int32_t height = fb->drm->crtc->mode.vdisplay;
+	int ret;
+
+	if (command_flags.pan_scroll && !command_flags.page_flip) {
+		ret = fb_bo_create(fb, &fb->bos[0], height * FB_PAN_SCREENS,
+				   pitch);
+		if (ret) {
+			LOG(WARNING, "Failed to create pan buffer, scrolling redraws the screen.");
+		} else {
+			fb->pan.height = height * FB_PAN_SCREENS;
+			fb->pan.fb_id = fb->bos[0].fb_id;
+		}
+	}
+
+	if (!fb->pan.height) {
+		ret = fb_bo_create(fb, &fb->bos[0], height, pitch);
+		if (ret)
+			return ret;
+	}
+	fb->num_bos = 1;
+
+	if (command_flags.page_flip) {
+		ret = fb_bo_create(fb, &fb->bos[1], height, pitch);
+		if (ret)
+			LOG(WARNING, "Failed to create back buffer, page flipping disabled.");
+		else
+			fb->num_bos = 2;
+	}
+
+	if (command_flags.shadow_fb) {
+		void* shadow;
+		if (posix_memalign(&shadow, 64, (size_t)*pitch * height)) {
+			LOG(WARNING, "Failed to allocate shadow buffer, drawing to the screen directly.");
+		} else {
+			memset(shadow, 0, (size_t)*pitch * height);
+			fb->shadow = shadow;
+		}
+	}
+
+	fb->back = 0;
+	fb->lock.map = fb->shadow ? fb->shadow : fb->bos[fb->back].map;
+
+	return 0;
+}
+
+static fb_bo_t* fb_front(fb_t* fb)
+{
+	return &fb->bos[(fb->back + 1) % fb->num_bos];
+}
+
+/*
+ * Copy a row of pixels into a write-combined or uncached mapping. On x86
+ * non-temporal stores fill whole write-combining lines without reading
+ * the destination, elsewhere memcpy already uses the widest stores.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void fb_copy_row(uint32_t* dst, const uint32_t* src, int32_t count)
+{
+	while (count > 0 && ((uintptr_t)dst & 15)) {
+		*dst++ = *src++;
+		count--;
+	}
+
+	for (; count >= 16; count -= 16, dst += 16, src += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)src);
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + 4));
+		__m128i c = _mm_loadu_si128((const __m128i*)(src + 8));
+		__m128i d = _mm_loadu_si128((const __m128i*)(src + 12));
+		_mm_stream_si128((__m128i*)dst, a);
+		_mm_stream_si128((__m128i*)(dst + 4), b);
+		_mm_stream_si128((__m128i*)(dst + 8), c);
+		_mm_stream_si128((__m128i*)(dst + 12), d);
+	}
+
+	for (; count >= 4; count -= 4, dst += 4, src += 4)
+		_mm_stream_si128((__m128i*)dst,
+				 _mm_loadu_si128((const __m128i*)src));
+
+	while (count-- > 0)
+		*dst++ = *src++;
+}
+
+__attribute__((target("sse2")))
+static void fb_copy_done(void)
+{
+	_mm_sfence();
+}
+#else
+static void fb_copy_row(uint32_t* dst, const uint32_t* src, int32_t count)
+{
+	memcpy(dst, src, count * sizeof(uint32_t));
+}
+
+static void fb_copy_done(void)
+{
+}
+#endif
+
+/* Copy the regions in |damage| from |src| to |dst|. */
+static void fb_copy_damage(fb_t* fb, uint32_t* dst, const uint32_t* src,
+			   fb_damage_t* damage)
+{
+	int32_t pitch4 = fb->buffer_properties.pitch / 4;
+
+	for (int32_t i = 0; i < damage->count; i++) {
+		struct drm_clip_rect* r = &damage->rects[i];
+		size_t offset = r->y1 * pitch4 + r->x1;
+
+		for (int32_t y = r->y1; y < r->y2; y++, offset += pitch4)
+			fb_copy_row(dst + offset, src + offset, r->x2 - r->x1);
+	}
+	fb_copy_done();
+}
+
+/* The buffer the next frame goes to, the back buffer or the pan window. */
+static uint32_t* fb_target_map(fb_t* fb)
+{
+	if (fb->pan.height)
+		return fb->bos[0].map +
+			fb->pan.y * (fb->buffer_properties.pitch / 4);
+	return fb->bos[fb->back].map;
+}
+
+/* Bring the damaged regions over from the shadow buffer, if there is one. */
+static void fb_upload_shadow(fb_t* fb)
+{
+	if (fb->shadow)
+		fb_copy_damage(fb, fb_target_map(fb), fb->shadow, &fb->damage);
+}
+
+/*
+ * Make the back buffer the front one. The new back buffer is brought up
+ * to date by copying the regions that changed since the previous swap.
+ */
+static void fb_swap_buffers(fb_t* fb, fb_damage_t* damage)
+{
+	fb->back = (fb->back + 1) % fb->num_bos;
+	fb_copy_damage(fb, fb->bos[fb->back].map,
+		       fb->shadow ? fb->shadow : fb_front(fb)->map, damage);
+	if (!fb->shadow)
+		fb->lock.map = fb->bos[fb->back].map;
+	damage->count = 0;
+}
+
+static void fb_flip_done(void* data)
+{
+	fb_t* fb = (fb_t*)data;
+
+	fb->flip_pending = false;
+	/* A frame being drawn after a stall is finished by fb_present(). */
+	if (fb->flip_stalled && fb->lock.count > 0)
 		return;
+	fb->flip_stalled = false;
+	fb_swap_buffers(fb, &fb->flip_damage);
+}
 
-	drmModeRmFB(fb->drm->fd, fb->fb_id);
-	fb->fb_id = 0;
-	destroy_dumb.handle = fb->buffer_handle;
-	drmIoctl(fb->drm->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_dumb);
-	fb->buffer_handle = 0;
+static void fb_wait_flip(fb_t* fb)
+{
+	if (!fb->flip_pending || fb->flip_stalled)
+		return;
+
+	drm_wait_page_flip(fb->drm, FB_FLIP_TIMEOUT_MS);
+	if (!fb->flip_pending)
+		return;
+
+	/*
+	 * The kernel may still be scanning out the front buffer, so keep
+	 * drawing into the buffer being flipped to. Once the flip completes
+	 * the other buffer is brought up to date in full.
+	 */
+	fb->flip_stalled = true;
+	fb->flip_damage.count = 1;
+	fb->flip_damage.rects[0] = (struct drm_clip_rect) {
+		0, 0, fb->buffer_properties.width, fb->buffer_properties.height
+	};
+}
+
+/* Remove a window fb, the one at y = 0 belongs to bos[0]. */
+static void fb_pan_remove_fb(fb_t* fb, uint32_t fb_id)
+{
+	if (fb_id && fb_id != fb->bos[0].fb_id)
+		drmModeRmFB(fb->drm->fd, fb_id);
+}
+
+static void fb_pan_release_retired(fb_t* fb)
+{
+	fb_pan_remove_fb(fb, fb->pan.retired_fb_id);
+	fb->pan.retired_fb_id = 0;
+}
+
+static void fb_pan_done(void* data)
+{
+	fb_t* fb = (fb_t*)data;
+
+	fb->flip_pending = false;
+	fb->flip_stalled = false;
+	fb_pan_release_retired(fb);
+}
+
+void fb_buffer_destroy(fb_t* fb)
+{
+	if (fb->num_bos <= 0)
+		return;
+
+	fb_wait_flip(fb);
+	if (fb->flip_pending)
+		drm_cancel_page_flip(fb->drm);
+	if (fb->pan.height) {
+		fb_pan_release_retired(fb);
+		fb_pan_remove_fb(fb, fb->pan.fb_id);
+		memset(&fb->pan, 0, sizeof(fb->pan));
+	}
+	for (int32_t i = 0; i < fb->num_bos; i++)
+		fb_bo_destroy(fb, &fb->bos[i]);
+	free(fb->shadow);
+	fb->shadow = NULL;
+	fb->num_bos = 0;
+	fb->back = 0;
+	fb->flip_pending = false;
+	fb->flip_stalled = false;
 	fb->lock.map = NULL;
 	fb->lock.count = 0;
+	fb->damage.count = 0;
+	fb->flip_damage.count = 0;
 	drm_delref(fb->drm);
 	fb->drm = NULL;
 }
@@ -153,8 +398,13 @@ int fb_buffer_init(fb_t* fb)
 {
 	int32_t width, height, pitch;
 	int32_t hsize_mm, vsize_mm;
+	drmModeModeInfo* mode;
 	int r;
 
+	/* A shared fb may already have been set up through another user. */
+	if (fb->num_bos > 0)
+		return 0;
+
 	/* reuse the buffer_properties if it was set before */
 	if (!fb->buffer_properties.width || !fb->buffer_properties.height ||
 		!fb->buffer_properties.pitch || !fb->buffer_properties.scaling) {
@@ -163,6 +413,7 @@ int fb_buffer_init(fb_t* fb)
 		fb->buffer_properties.height = 480;
 		fb->buffer_properties.pitch = 640 * 4;
 		fb->buffer_properties.scaling = 1;
+		fb->buffer_properties.refresh = 60;
 	}
 
 	fb->drm = drm_addref();
@@ -185,6 +436,15 @@ int fb_buffer_init(fb_t* fb)
 	fb->buffer_properties.height = height;
 	fb->buffer_properties.pitch = pitch;
 
+	mode = &fb->drm->crtc->mode;
+	if (mode->vrefresh)
+		fb->buffer_properties.refresh = mode->vrefresh;
+	else if (mode->htotal && mode->vtotal)
+		fb->buffer_properties.refresh =
+			(mode->clock * 1000LL) / (mode->htotal * mode->vtotal);
+	if (fb->buffer_properties.refresh <= 0)
+		fb->buffer_properties.refresh = 60;
+
 	hsize_mm = fb->drm->main_monitor_connector->mmWidth;
 	vsize_mm = fb->drm->main_monitor_connector->mmHeight;
 	if (drm_read_edid(fb->drm))
@@ -228,29 +488,196 @@ void fb_close(fb_t* fb)
 
 int32_t fb_setmode(fb_t* fb)
 {
+	int32_t ret;
+
 	/* headless mode */
 	if (!drm_valid(fb->drm))
 		return 0;
 
-	return drm_setmode(fb->drm, fb->fb_id);
+	fb_wait_flip(fb);
+
+	if (fb->num_bos > 1) {
+		/*
+		 * Show the most recent contents and draw into the other buffer.
+		 * The mode set completes a stalled flip, which already swaps.
+		 */
+		bool stalled = fb->flip_pending;
+
+		fb_upload_shadow(fb);
+		ret = drm_setmode(fb->drm, fb->bos[fb->back].fb_id);
+		if (!ret && !stalled)
+			fb_swap_buffers(fb, &fb->damage);
+		return ret;
+	}
+
+	if (fb->shadow) {
+		fb_damage_all(fb);
+		fb_upload_shadow(fb);
+	}
+
+	if (fb->pan.height) {
+		ret = drm_setmode(fb->drm, fb->pan.fb_id);
+		if (!ret) {
+			fb_pan_release_retired(fb);
+			fb->pan.moved = false;
+		}
+	} else {
+		ret = drm_setmode(fb->drm, fb->bos[0].fb_id);
+	}
+
+	/* Upload the whole screen on the next flush. */
+	if (!ret)
+		fb_damage_all(fb);
+
+	return ret;
+}
+
+static uint64_t rect_area(const struct drm_clip_rect* r)
+{
+	return (uint64_t)(r->x2 - r->x1) * (r->y2 - r->y1);
+}
+
+static void rect_union(struct drm_clip_rect* dst,
+		       const struct drm_clip_rect* a,
+		       const struct drm_clip_rect* b)
+{
+	dst->x1 = MIN(a->x1, b->x1);
+	dst->y1 = MIN(a->y1, b->y1);
+	dst->x2 = MAX(a->x2, b->x2);
+	dst->y2 = MAX(a->y2, b->y2);
+}
+
+/* Pixels covered by the union of |a| and |b| but by neither of them. */
+static uint64_t rect_waste(const struct drm_clip_rect* a,
+			   const struct drm_clip_rect* b)
+{
+	struct drm_clip_rect u;
+	uint64_t overlap = 0;
+	int32_t ow, oh;
+
+	rect_union(&u, a, b);
+	ow = MIN(a->x2, b->x2) - MAX(a->x1, b->x1);
+	oh = MIN(a->y2, b->y2) - MAX(a->y1, b->y1);
+	if (ow > 0 && oh > 0)
+		overlap = (uint64_t)ow * oh;
+
+	return rect_area(&u) + overlap - rect_area(a) - rect_area(b);
 }
 
 uint32_t* fb_lock(fb_t* fb)
 {
-	if (fb->lock.count == 0 && fb->buffer_handle > 0) {
-		fb->lock.map =
-			mmap(0, fb->buffer_properties.size, PROT_READ | PROT_WRITE,
-					MAP_SHARED, fb->drm->fd, fb->lock.map_offset);
-		if (fb->lock.map == MAP_FAILED) {
-			LOG(ERROR, "mmap failed");
-			return NULL;
+	if (fb->num_bos <= 0 || !fb->lock.map)
+		return NULL;
+
+	/* Neither buffer may be touched until the pending flip completes. */
+	if (fb->lock.count == 0)
+		fb_wait_flip(fb);
+
+	fb->lock.count++;
+	return fb->lock.map;
+}
+
+static void fb_count_damage(fb_damage_t* damage)
+{
+	damage->frame_pixels = 0;
+	for (int32_t i = 0; i < damage->count; i++)
+		damage->frame_pixels += rect_area(&damage->rects[i]);
+}
+
+static void fb_flush_damage(fb_t* fb, uint32_t fb_id)
+{
+	fb_damage_t* damage = &fb->damage;
+	int32_t ret;
+
+	fb_count_damage(damage);
+
+	ret = drmModeDirtyFB(fb->drm->fd, fb_id, damage->rects,
+			     damage->count);
+	if (ret && errno != ENOSYS)
+		LOG(ERROR, "drmModeDirtyFB failed: %m");
+
+	damage->count = 0;
+}
+
+/*
+ * Show a window that moved by flipping to its fb. The old window stays on
+ * screen until the flip completes, so it is only removed then.
+ */
+static void fb_present_pan(fb_t* fb)
+{
+	if (fb->pan.moved) {
+		fb->pan.moved = false;
+		if (fb->pan.retired_fb_id) {
+			if (!drm_page_flip(fb->drm, fb->pan.fb_id,
+					   fb_pan_done, fb)) {
+				fb_count_damage(&fb->damage);
+				fb->damage.count = 0;
+				fb->flip_pending = true;
+				return;
+			}
+
+			/* Flipping is not possible right now, set the mode. */
+			if (drm_setmode(fb->drm, fb->pan.fb_id))
+				LOG(ERROR, "Failed to show scrolled window.");
+			fb_pan_release_retired(fb);
 		}
 	}
 
-	if (fb->lock.map)
-		fb->lock.count++;
+	fb_flush_damage(fb, fb->pan.fb_id);
+}
 
-	return fb->lock.map;
+static void fb_present(fb_t* fb)
+{
+	fb_bo_t* front;
+
+	if (fb->flip_stalled && fb->num_bos > 1) {
+		if (fb->damage.count) {
+			fb_upload_shadow(fb);
+			fb_flush_damage(fb, fb->bos[fb->back].fb_id);
+		}
+		if (!fb->flip_pending)
+			fb_flip_done(fb);
+		return;
+	}
+
+	if (!fb->damage.count)
+		return;
+
+	if (fb->pan.height) {
+		fb_upload_shadow(fb);
+		fb_present_pan(fb);
+		return;
+	}
+
+	if (fb->num_bos == 1) {
+		fb_upload_shadow(fb);
+		fb_flush_damage(fb, fb->bos[0].fb_id);
+		return;
+	}
+
+	/*
+	 * While another fb is on screen keep accumulating damage, it is
+	 * brought over to the other buffer by fb_setmode().
+	 */
+	front = fb_front(fb);
+	if (!drm_is_scanout(fb->drm, front->fb_id))
+		return;
+
+	fb_upload_shadow(fb);
+	if (!drm_page_flip(fb->drm, fb->bos[fb->back].fb_id,
+			   fb_flip_done, fb)) {
+		fb_count_damage(&fb->damage);
+		fb->flip_damage = fb->damage;
+		fb->damage.count = 0;
+		fb->flip_pending = true;
+		return;
+	}
+
+	/* Flipping is not possible right now, update the front buffer. */
+	fb_copy_damage(fb, front->map,
+		       fb->shadow ? fb->shadow : fb->bos[fb->back].map,
+		       &fb->damage);
+	fb_flush_damage(fb, front->fb_id);
 }
 
 void fb_unlock(fb_t* fb)
@@ -260,16 +687,190 @@ void fb_unlock(fb_t* fb)
 	else
 		LOG(ERROR, "fb locking unbalanced");
 
-	if (fb->lock.count == 0 && fb->buffer_handle > 0) {
-		int32_t ret;
-		struct drm_clip_rect clip_rect = {
-			0, 0, fb->buffer_properties.width, fb->buffer_properties.height
-		};
-		munmap(fb->lock.map, fb->buffer_properties.size);
-		ret = drmModeDirtyFB(fb->drm->fd, fb->fb_id, &clip_rect, 1);
-		if (ret && errno != ENOSYS)
-			LOG(ERROR, "drmModeDirtyFB failed: %m");
+	if (fb->lock.count == 0 && fb->num_bos > 0)
+		fb_present(fb);
+}
+
+bool fb_flip_pending(fb_t* fb)
+{
+	return fb->flip_pending && !fb->flip_stalled;
+}
+
+bool fb_can_scroll(fb_t* fb)
+{
+	return fb->pan.height > 0 || fb->shadow;
+}
+
+/* Move the shadow buffer contents up by |lines|, down if negative. */
+static void fb_scroll_shadow(fb_t* fb, int32_t lines)
+{
+	int32_t height = fb->buffer_properties.height;
+	size_t pitch = fb->buffer_properties.pitch;
+	char* shadow = (char*)fb->shadow;
+
+	if (lines > 0)
+		memmove(shadow, shadow + lines * pitch, (height - lines) * pitch);
+	else
+		memmove(shadow - lines * pitch, shadow, (height + lines) * pitch);
+}
+
+/*
+ * Scroll the screen contents up by |lines| (down if negative) by moving
+ * the visible window. Returns true if the contents moved, the caller then
+ * only has to draw the uncovered lines. Otherwise, including when the
+ * window wrapped to the top of the buffer, everything has to be redrawn.
+ * Must not be called while the fb is locked.
+ */
+bool fb_scroll(fb_t* fb, int32_t lines)
+{
+	int32_t height = fb->buffer_properties.height;
+	uint32_t pitch = fb->buffer_properties.pitch;
+	int32_t y = fb->pan.y + lines;
+	uint32_t offset, old_fb_id, fb_id;
+	bool scrolled = true;
+
+	if (fb->lock.count || lines <= -height || lines >= height)
+		return false;
+
+	if (!fb->pan.height) {
+		/* Without panning the moved contents are uploaded in full. */
+		if (!fb->shadow)
+			return false;
+		fb_scroll_shadow(fb, lines);
+		fb_damage_all(fb);
+		return true;
+	}
+
+	if (y < 0 || y + height > fb->pan.height) {
+		y = 0;
+		scrolled = false;
+	}
+	if (y == fb->pan.y)
+		return scrolled;
+
+	/*
+	 * The retired window has to be off screen before it is replaced.
+	 * While the flip is stalled, stay on the current window.
+	 */
+	fb_wait_flip(fb);
+	if (fb->flip_pending)
+		return false;
+
+	if (y == 0) {
+		fb_id = fb->bos[0].fb_id;
+	} else {
+		offset = y * pitch;
+		if (drmModeAddFB2(fb->drm->fd, fb->buffer_properties.width,
+				  height, DRM_FORMAT_XRGB8888,
+				  &fb->bos[0].handle, &pitch,
+				  &offset, &fb_id, 0)) {
+			LOG(ERROR, "drmModeAddFB2 failed for scroll window");
+			return false;
+		}
 	}
+
+	old_fb_id = fb->pan.fb_id;
+	if (drm_is_scanout(fb->drm, old_fb_id)) {
+		fb_pan_release_retired(fb);
+		fb->pan.retired_fb_id = old_fb_id;
+	} else {
+		fb_pan_remove_fb(fb, old_fb_id);
+	}
+
+	fb->pan.y = y;
+	fb->pan.fb_id = fb_id;
+	fb->pan.moved = true;
+	if (fb->shadow) {
+		if (scrolled)
+			fb_scroll_shadow(fb, lines);
+	} else {
+		fb->lock.map = fb->bos[0].map + y * (pitch / 4);
+	}
+
+	return scrolled;
+}
+
+void fb_damage(fb_t* fb, int32_t x, int32_t y, int32_t w, int32_t h)
+{
+	fb_damage_t* damage = &fb->damage;
+	struct drm_clip_rect r, u;
+	uint64_t best_waste = UINT64_MAX;
+	int32_t best_i = 0, best_j = 0;
+
+	/* Clip to the buffer. */
+	if (x < 0) {
+		w += x;
+		x = 0;
+	}
+	if (y < 0) {
+		h += y;
+		y = 0;
+	}
+	if (x + w > fb->buffer_properties.width)
+		w = fb->buffer_properties.width - x;
+	if (y + h > fb->buffer_properties.height)
+		h = fb->buffer_properties.height - y;
+	if (w <= 0 || h <= 0)
+		return;
+
+	r.x1 = x;
+	r.y1 = y;
+	r.x2 = x + w;
+	r.y2 = y + h;
+
+	/*
+	 * Merge into an existing rectangle if the union does not cover more
+	 * extra pixels than the new rectangle itself. This keeps the uploaded
+	 * area within twice the area that was actually drawn.
+	 */
+	for (int32_t i = 0; i < damage->count; i++) {
+		if (rect_waste(&damage->rects[i], &r) <= rect_area(&r)) {
+			rect_union(&damage->rects[i], &damage->rects[i], &r);
+			return;
+		}
+	}
+
+	if (damage->count < FB_MAX_DAMAGE_RECTS) {
+		damage->rects[damage->count++] = r;
+		return;
+	}
+
+	/*
+	 * The list is full, merge the closest pair to make room. The new
+	 * rectangle takes part as index FB_MAX_DAMAGE_RECTS.
+	 */
+	for (int32_t i = 0; i < FB_MAX_DAMAGE_RECTS; i++) {
+		for (int32_t j = i + 1; j <= FB_MAX_DAMAGE_RECTS; j++) {
+			const struct drm_clip_rect* b =
+				(j == FB_MAX_DAMAGE_RECTS) ? &r : &damage->rects[j];
+			uint64_t waste = rect_waste(&damage->rects[i], b);
+			if (waste < best_waste) {
+				best_waste = waste;
+				best_i = i;
+				best_j = j;
+			}
+		}
+	}
+
+	if (best_j == FB_MAX_DAMAGE_RECTS) {
+		rect_union(&damage->rects[best_i], &damage->rects[best_i], &r);
+	} else {
+		rect_union(&u, &damage->rects[best_i], &damage->rects[best_j]);
+		damage->rects[best_i] = u;
+		damage->rects[best_j] = r;
+	}
+}
+
+void fb_damage_all(fb_t* fb)
+{
+	fb->damage.count = 0;
+	fb_damage(fb, 0, 0, fb->buffer_properties.width,
+		  fb->buffer_properties.height);
+}
+
+uint64_t fb_get_damaged_pixels(fb_t* fb)
+{
+	return fb->damage.frame_pixels;
 }
 
 int32_t fb_getwidth(fb_t* fb)
@@ -291,3 +892,13 @@ int32_t fb_getscaling(fb_t* fb)
 {
 	return fb->buffer_properties.scaling;
 }
+
+int64_t fb_getsize(fb_t* fb)
+{
+	return (int64_t)fb->buffer_properties.size * fb->num_bos;
+}
+
+int32_t fb_getrefresh(fb_t* fb)
+{
+	return fb->buffer_properties.refresh;
+}
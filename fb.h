@@ -15,20 +15,72 @@ typedef struct {
 	int32_t pitch;
 	int32_t scaling;
 	int32_t size;
+	int32_t refresh;
 } buffer_properties_t;
 
 typedef struct {
 	int32_t count;
-	uint64_t map_offset;
 	uint32_t* map;
 } fb_lock_t;
 
+#define FB_MAX_BUFFERS 2
+
+typedef struct {
+	uint32_t handle;
+	uint32_t fb_id;
+	uint32_t* map;
+} fb_bo_t;
+
+#define FB_MAX_DAMAGE_RECTS 16
+
+/*
+ * Regions touched since the last flush. The list is bounded, nearby
+ * rectangles get merged so it never holds more than FB_MAX_DAMAGE_RECTS.
+ */
+typedef struct {
+	int32_t count;
+	struct drm_clip_rect rects[FB_MAX_DAMAGE_RECTS];
+	uint64_t frame_pixels;
+} fb_damage_t;
+
+/*
+ * Pan scrolling. bos[0] is taller than the screen, which shows the window
+ * of it starting at line y. Scrolling moves the window instead of
+ * redrawing the whole screen.
+ */
+typedef struct {
+	int32_t height;
+	int32_t y;
+	uint32_t fb_id;
+	uint32_t retired_fb_id;
+	bool moved;
+} fb_pan_t;
+
 typedef struct {
 	drm_t *drm;
 	buffer_properties_t buffer_properties;
 	fb_lock_t lock;
-	uint32_t buffer_handle;
-	uint32_t fb_id;
+	fb_damage_t damage;
+	/*
+	 * With page flipping enabled there are two buffers, bos[back] is
+	 * drawn into while the other one is scanned out. Otherwise bos[0] is
+	 * both. flip_damage holds the regions of the frame in flight, they
+	 * are copied into the new back buffer once the flip completes. A
+	 * stalled flip was given up on by fb_wait_flip(), meanwhile bos[back]
+	 * is drawn into and updated on screen like a single buffer.
+	 */
+	fb_bo_t bos[FB_MAX_BUFFERS];
+	int32_t num_bos;
+	int32_t back;
+	bool flip_pending;
+	bool flip_stalled;
+	fb_damage_t flip_damage;
+	fb_pan_t pan;
+	/*
+	 * Optional copy of the screen in cached memory. When present all
+	 * drawing goes here and only damaged regions reach the dumb buffers.
+	 */
+	uint32_t* shadow;
 } fb_t;
 
 fb_t* fb_init(void);
@@ -38,9 +90,17 @@ int fb_buffer_init(fb_t* fb);
 void fb_buffer_destroy(fb_t* fb);
 uint32_t* fb_lock(fb_t* fb);
 void fb_unlock(fb_t* fb);
+bool fb_flip_pending(fb_t* fb);
+bool fb_can_scroll(fb_t* fb);
+bool fb_scroll(fb_t* fb, int32_t lines);
+void fb_damage(fb_t* fb, int32_t x, int32_t y, int32_t w, int32_t h);
+void fb_damage_all(fb_t* fb);
+uint64_t fb_get_damaged_pixels(fb_t* fb);
 int32_t fb_getwidth(fb_t* fb);
 int32_t fb_getheight(fb_t* fb);
 int32_t fb_getpitch(fb_t* fb);
 int32_t fb_getscaling(fb_t* fb);
+int32_t fb_getrefresh(fb_t* fb);
+int64_t fb_getsize(fb_t* fb);
 
 #endif
@@ -4,7 +4,18 @@
  * found in the LICENSE file.
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "font.h"
 #include "glyphs.h"
@@ -12,11 +23,106 @@
 
 #define UNICODE_REPLACEMENT_CHARACTER_CODE_POINT 0xFFFD
 
+#define GLYPH_COUNT (int)(sizeof(glyphs) / (GLYPH_BYTES_PER_ROW * GLYPH_HEIGHT))
+
+/*
+ * The font in use, the built-in one from glyphs.h unless font_load()
+ * mapped a PSF2 file. Glyphs of a mapped font are only paged in when
+ * drawn. Its code points are looked up like in glyphs.h, page_map
+ * selects one of |pages|, page 0 has no glyphs.
+ */
+#define FONT_MAX_GLYPH_SIZE	64
+#define FONT_UNICODE_PAGES	(0x110000 >> 8)
+
+static struct {
+	int width;
+	int height;
+	int bytes_per_row;
+	int count;
+	const uint8_t* glyphs;
+	bool space_blank;
+	void* map;
+	size_t map_size;
+	uint16_t* page_map;
+	int32_t (*pages)[256];
+	int num_pages;
+} face = {
+	.width = GLYPH_WIDTH,
+	.height = GLYPH_HEIGHT,
+	.bytes_per_row = GLYPH_BYTES_PER_ROW,
+	.count = GLYPH_COUNT,
+	.glyphs = glyphs[0],
+	.space_blank = true,
+};
+
+static int32_t face_glyph_index(uint32_t ch)
+{
+	if (!face.map)
+		return code_point_to_glyph_index(ch);
+
+	if (!face.page_map)
+		return ch < (uint32_t)face.count ? (int32_t)ch : -1;
+
+	if (ch >= FONT_UNICODE_PAGES << 8)
+		return -1;
+	return face.pages[face.page_map[ch >> 8]][ch & 0xff];
+}
+
 static int font_scaling = 1;
 static int glyph_size = GLYPH_BYTES_PER_ROW * GLYPH_HEIGHT;
-static uint8_t* prescaled_glyphs = NULL;
 static int font_ref = 0;
 
+/*
+ * Scales up to GLYPH_MAX_PRESCALED of the built-in font have a table of
+ * glyphs scaled at build time in glyphs.h, used as is. Otherwise scaled
+ * glyphs are only produced when first drawn. scale_lut holds, for every
+ * 3x3 neighborhood of a source pixel, the scaling x scaling block of
+ * subpixels it turns into, bit (sy * scaling + sx) set for a 1.
+ * glyph_scaled tells which glyphs of scaled_glyphs were produced.
+ */
+#define FONT_MAX_SCALING 8
+
+static const uint8_t* baked_glyphs = NULL;
+static uint8_t* scaled_glyphs = NULL;
+static bool* glyph_scaled = NULL;
+static uint64_t scale_lut[1 << 9];
+
+/*
+ * Cache of glyphs already expanded to 32bpp with their colors applied, so
+ * redrawing a cell that was drawn before is a plain copy. Entries are
+ * looked up by (glyph, front color, back color), the cache is flushed when
+ * the scaling changes so all entries are always at font_scaling. When full,
+ * the least recently used entry is recycled. Unless set explicitly, the
+ * size grows with the area of a glyph, so the cache holds as many glyphs
+ * at every scaling.
+ */
+#define GLYPH_CACHE_DEFAULT_SIZE	(1024 * 1024)
+#define GLYPH_CACHE_HASH_BITS		10
+#define GLYPH_CACHE_HASH_SIZE		(1 << GLYPH_CACHE_HASH_BITS)
+
+typedef struct glyph_cache_entry {
+	int32_t glyph_index;
+	uint32_t front_color;
+	uint32_t back_color;
+	struct glyph_cache_entry* hash_next;
+	struct glyph_cache_entry* lru_prev;
+	struct glyph_cache_entry* lru_next;
+	uint32_t pixels[];
+} glyph_cache_entry_t;
+
+static struct {
+	size_t size;
+	bool size_set;
+	int scaling;
+	int max_entries;
+	int num_entries;
+	glyph_cache_entry_t* buckets[GLYPH_CACHE_HASH_SIZE];
+	glyph_cache_entry_t* lru_head;
+	glyph_cache_entry_t* lru_tail;
+	uint64_t hits;
+	uint64_t misses;
+} glyph_cache;
+
 static uint8_t get_bit(const uint8_t* buffer, int bit_offset)
 {
 	return (buffer[bit_offset / 8] >> (7 - (bit_offset % 8))) & 0x1;
@@ -29,9 +135,9 @@ static void set_bit(uint8_t* buffer, int bit_offset)
 
 static uint8_t glyph_pixel(const uint8_t* glyph, int x, int y)
 {
-	if (x < 0 || x >= GLYPH_WIDTH || y < 0 || y >= GLYPH_HEIGHT)
+	if (x < 0 || x >= face.width || y < 0 || y >= face.height)
 		return 0;
-	return get_bit(&glyph[y * GLYPH_BYTES_PER_ROW], x);
+	return get_bit(&glyph[y * face.bytes_per_row], x);
 }
 
 static uint8_t scale_pixel(uint32_t neighbors, int sx, int sy, int scaling)
@@ -108,11 +214,26 @@ static uint8_t scale_pixel(uint32_t neighbors, int sx, int sy, int scaling)
 	}
 }
 
+static void build_scale_lut(int scaling)
+{
+	for (uint32_t neighbors = 0; neighbors < ARRAY_SIZE(scale_lut); neighbors++) {
+		uint64_t bits = 0;
+
+		for (int sy = 0; sy < scaling; sy++)
+			for (int sx = 0; sx < scaling; sx++)
+				if (scale_pixel(neighbors, sx, sy, scaling))
+					bits |= 1ull << (sy * scaling + sx);
+		scale_lut[neighbors] = bits;
+	}
+}
+
 static void scale_glyph(uint8_t* dst, const uint8_t* src, int scaling)
 {
-	for (int y = 0; y < GLYPH_HEIGHT; y++) {
-		for (int x = 0; x < GLYPH_WIDTH; x++) {
+	for (int y = 0; y < face.height; y++) {
+		for (int x = 0; x < face.width; x++) {
 			uint32_t neighbors = 0;
+			uint64_t bits;
+
 			for (int dy = -1; dy <= 1; dy++) {
 				for (int dx = -1; dx <= 1; dx++) {
 					neighbors <<= 1;
@@ -120,42 +241,537 @@ static void scale_glyph(uint8_t* dst, const uint8_t* src, int scaling)
 						src, x + dx, y + dy);
 				}
 			}
+			bits = scale_lut[neighbors];
 			for (int sy = 0; sy < scaling; sy++) {
 				uint8_t* dst_row = &dst[(y * scaling + sy) *
-					GLYPH_BYTES_PER_ROW * scaling];
+					face.bytes_per_row * scaling];
 				for (int sx = 0; sx < scaling; sx++) {
-					if (scale_pixel(neighbors, sx, sy,
-							scaling)) {
+					if (bits & (1ull << (sy * scaling + sx)))
 						set_bit(dst_row,
 							x * scaling + sx);
-					}
 				}
 			}
 		}
 	}
 }
 
-static void prescale_font(int scaling)
+static int prepare_scaling(int scaling)
+{
+	if (!face.map && scaling <= GLYPH_MAX_PRESCALED &&
+	    prescaled_glyphs[scaling]) {
+		baked_glyphs = prescaled_glyphs[scaling];
+		return 0;
+	}
+
+	scaled_glyphs = calloc(face.count, glyph_size);
+	glyph_scaled = calloc(face.count, sizeof(*glyph_scaled));
+	if (!scaled_glyphs || !glyph_scaled) {
+		LOG(ERROR, "Out of memory for scaled glyphs.");
+		free(scaled_glyphs);
+		free(glyph_scaled);
+		scaled_glyphs = NULL;
+		glyph_scaled = NULL;
+		return -1;
+	}
+	build_scale_lut(scaling);
+	return 0;
+}
+
+static const uint8_t* scaled_glyph(int32_t glyph_index)
+{
+	uint8_t* glyph = &scaled_glyphs[glyph_index * glyph_size];
+
+	if (!glyph_scaled[glyph_index]) {
+		scale_glyph(glyph, &face.glyphs[glyph_index * face.height *
+						face.bytes_per_row],
+			    font_scaling);
+		glyph_scaled[glyph_index] = true;
+	}
+	return glyph;
+}
+
+/*
+ * Glyph row expansion. Each kernel turns |width| pixels of a 1bpp glyph
+ * row into 32bpp pixels, set bits become |front_color|, clear bits
+ * |back_color|. The vector kernels produce exactly the same output as
+ * the scalar one, the best one for the CPU is picked in font_init().
+ */
+typedef void (*expand_row_t)(uint32_t* dst, const uint8_t* src, int width,
+			     uint32_t front_color, uint32_t back_color);
+
+static void expand_row_scalar(uint32_t* dst, const uint8_t* src, int width,
+			      uint32_t front_color, uint32_t back_color)
+{
+	for (int i = 0; i < width; i++)
+		dst[i] = get_bit(src, i) ? front_color : back_color;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void expand_row_sse2(uint32_t* dst, const uint8_t* src, int width,
+			    uint32_t front_color, uint32_t back_color)
+{
+	const __m128i hi_bits = _mm_set_epi32(0x10, 0x20, 0x40, 0x80);
+	const __m128i lo_bits = _mm_set_epi32(0x01, 0x02, 0x04, 0x08);
+	const __m128i fg = _mm_set1_epi32(front_color);
+	const __m128i bg = _mm_set1_epi32(back_color);
+	int i;
+
+	/* 8 pixels per source byte, 4 per store. */
+	for (i = 0; i + 8 <= width; i += 8) {
+		__m128i bits = _mm_set1_epi32(src[i / 8]);
+		__m128i hi = _mm_cmpeq_epi32(_mm_and_si128(bits, hi_bits), hi_bits);
+		__m128i lo = _mm_cmpeq_epi32(_mm_and_si128(bits, lo_bits), lo_bits);
+
+		_mm_storeu_si128((__m128i*)&dst[i],
+			_mm_or_si128(_mm_and_si128(hi, fg), _mm_andnot_si128(hi, bg)));
+		_mm_storeu_si128((__m128i*)&dst[i + 4],
+			_mm_or_si128(_mm_and_si128(lo, fg), _mm_andnot_si128(lo, bg)));
+	}
+
+	for (; i < width; i++)
+		dst[i] = get_bit(src, i) ? front_color : back_color;
+}
+
+__attribute__((target("avx2")))
+static void expand_row_avx2(uint32_t* dst, const uint8_t* src, int width,
+			    uint32_t front_color, uint32_t back_color)
+{
+	const __m256i bit_mask = _mm256_set_epi32(0x01, 0x02, 0x04, 0x08,
+						  0x10, 0x20, 0x40, 0x80);
+	const __m256i fg = _mm256_set1_epi32(front_color);
+	const __m256i bg = _mm256_set1_epi32(back_color);
+	int i;
+
+	/* 16 pixels per iteration, 8 per store. */
+	for (i = 0; i + 16 <= width; i += 16) {
+		__m256i b0 = _mm256_set1_epi32(src[i / 8]);
+		__m256i b1 = _mm256_set1_epi32(src[i / 8 + 1]);
+		__m256i m0 = _mm256_cmpeq_epi32(_mm256_and_si256(b0, bit_mask), bit_mask);
+		__m256i m1 = _mm256_cmpeq_epi32(_mm256_and_si256(b1, bit_mask), bit_mask);
+
+		_mm256_storeu_si256((__m256i*)&dst[i], _mm256_blendv_epi8(bg, fg, m0));
+		_mm256_storeu_si256((__m256i*)&dst[i + 8], _mm256_blendv_epi8(bg, fg, m1));
+	}
+
+	for (; i + 8 <= width; i += 8) {
+		__m256i b = _mm256_set1_epi32(src[i / 8]);
+		__m256i m = _mm256_cmpeq_epi32(_mm256_and_si256(b, bit_mask), bit_mask);
+
+		_mm256_storeu_si256((__m256i*)&dst[i], _mm256_blendv_epi8(bg, fg, m));
+	}
+
+	for (; i < width; i++)
+		dst[i] = get_bit(src, i) ? front_color : back_color;
+}
+#elif defined(__ARM_NEON)
+static void expand_row_neon(uint32_t* dst, const uint8_t* src, int width,
+			    uint32_t front_color, uint32_t back_color)
+{
+	static const uint32_t hi[4] = { 0x80, 0x40, 0x20, 0x10 };
+	static const uint32_t lo[4] = { 0x08, 0x04, 0x02, 0x01 };
+	const uint32x4_t hi_bits = vld1q_u32(hi);
+	const uint32x4_t lo_bits = vld1q_u32(lo);
+	const uint32x4_t fg = vdupq_n_u32(front_color);
+	const uint32x4_t bg = vdupq_n_u32(back_color);
+	int i;
+
+	for (i = 0; i + 8 <= width; i += 8) {
+		uint32x4_t bits = vdupq_n_u32(src[i / 8]);
+
+		vst1q_u32(&dst[i], vbslq_u32(vtstq_u32(bits, hi_bits), fg, bg));
+		vst1q_u32(&dst[i + 4], vbslq_u32(vtstq_u32(bits, lo_bits), fg, bg));
+	}
+
+	for (; i < width; i++)
+		dst[i] = get_bit(src, i) ? front_color : back_color;
+}
+#endif
+
+static expand_row_t expand_row = expand_row_scalar;
+
+static size_t glyph_cache_entry_size(void)
+{
+	return sizeof(glyph_cache_entry_t) + sizeof(uint32_t) *
+		face.width * face.height * font_scaling * font_scaling;
+}
+
+static uint32_t glyph_cache_hash(int32_t glyph_index, uint32_t front_color,
+				 uint32_t back_color)
+{
+	uint32_t h = (uint32_t)glyph_index * 2654435761u;
+
+	h ^= front_color * 0x85ebca6bu;
+	h ^= back_color * 0xc2b2ae35u;
+	return h >> (32 - GLYPH_CACHE_HASH_BITS);
+}
+
+static void glyph_cache_unlink_lru(glyph_cache_entry_t* entry)
+{
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		glyph_cache.lru_head = entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		glyph_cache.lru_tail = entry->lru_prev;
+}
+
+static void glyph_cache_push_lru(glyph_cache_entry_t* entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = glyph_cache.lru_head;
+	if (glyph_cache.lru_head)
+		glyph_cache.lru_head->lru_prev = entry;
+	else
+		glyph_cache.lru_tail = entry;
+	glyph_cache.lru_head = entry;
+}
+
+static void glyph_cache_unlink_hash(glyph_cache_entry_t* entry)
+{
+	glyph_cache_entry_t** p = &glyph_cache.buckets[glyph_cache_hash(
+		entry->glyph_index, entry->front_color, entry->back_color)];
+
+	while (*p != entry)
+		p = &(*p)->hash_next;
+	*p = entry->hash_next;
+}
+
+static void glyph_cache_flush(void)
+{
+	glyph_cache_entry_t* entry = glyph_cache.lru_head;
+
+	if (glyph_cache.hits || glyph_cache.misses)
+		LOG(INFO, "Glyph cache: %llu hits, %llu misses, %d entries.",
+		    (unsigned long long)glyph_cache.hits,
+		    (unsigned long long)glyph_cache.misses,
+		    glyph_cache.num_entries);
+
+	while (entry) {
+		glyph_cache_entry_t* next = entry->lru_next;
+		free(entry);
+		entry = next;
+	}
+	memset(glyph_cache.buckets, 0, sizeof(glyph_cache.buckets));
+	glyph_cache.lru_head = NULL;
+	glyph_cache.lru_tail = NULL;
+	glyph_cache.num_entries = 0;
+	glyph_cache.hits = 0;
+	glyph_cache.misses = 0;
+	glyph_cache.scaling = font_scaling;
+	if (!glyph_cache.size_set)
+		glyph_cache.size = GLYPH_CACHE_DEFAULT_SIZE *
+				   font_scaling * font_scaling;
+	glyph_cache.max_entries = glyph_cache.size / glyph_cache_entry_size();
+}
+
+static glyph_cache_entry_t* glyph_cache_lookup(int32_t glyph_index,
+					       uint32_t front_color,
+					       uint32_t back_color)
+{
+	glyph_cache_entry_t* entry = glyph_cache.buckets[glyph_cache_hash(
+		glyph_index, front_color, back_color)];
+
+	for (; entry; entry = entry->hash_next) {
+		if (entry->glyph_index == glyph_index &&
+		    entry->front_color == front_color &&
+		    entry->back_color == back_color) {
+			if (entry != glyph_cache.lru_head) {
+				glyph_cache_unlink_lru(entry);
+				glyph_cache_push_lru(entry);
+			}
+			glyph_cache.hits++;
+			return entry;
+		}
+	}
+	glyph_cache.misses++;
+	return NULL;
+}
+
+/* Returns an entry for the key with unfilled pixels, or NULL. */
+static glyph_cache_entry_t* glyph_cache_insert(int32_t glyph_index,
+					       uint32_t front_color,
+					       uint32_t back_color)
+{
+	glyph_cache_entry_t* entry;
+	uint32_t bucket;
+
+	if (glyph_cache.max_entries == 0)
+		return NULL;
+
+	if (glyph_cache.num_entries < glyph_cache.max_entries) {
+		entry = malloc(glyph_cache_entry_size());
+		if (!entry)
+			return NULL;
+		glyph_cache.num_entries++;
+	} else {
+		entry = glyph_cache.lru_tail;
+		glyph_cache_unlink_lru(entry);
+		glyph_cache_unlink_hash(entry);
+	}
+
+	entry->glyph_index = glyph_index;
+	entry->front_color = front_color;
+	entry->back_color = back_color;
+	bucket = glyph_cache_hash(glyph_index, front_color, back_color);
+	entry->hash_next = glyph_cache.buckets[bucket];
+	glyph_cache.buckets[bucket] = entry;
+	glyph_cache_push_lru(entry);
+	return entry;
+}
+
+void font_set_cache_size(size_t size)
+{
+	glyph_cache.size = size;
+	glyph_cache.size_set = true;
+	glyph_cache_flush();
+}
+
+#define PSF2_MAGIC		0x864ab572
+#define PSF2_HAS_UNICODE_TABLE	0x01
+#define PSF2_SEPARATOR		0xff
+#define PSF2_START_SEQUENCE	0xfe
+
+struct psf2_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t flags;
+	uint32_t length;
+	uint32_t charsize;
+	uint32_t height;
+	uint32_t width;
+};
+
+static uint32_t font_decode_utf8(const uint8_t** p, const uint8_t* end)
+{
+	const uint8_t* s = *p;
+	uint32_t cp = *s++;
+	int extra = cp >= 0xf0 ? 3 : cp >= 0xe0 ? 2 : cp >= 0xc0 ? 1 : 0;
+
+	if (extra)
+		cp &= 0x3f >> extra;
+	while (extra-- > 0 && s < end && (*s & 0xc0) == 0x80)
+		cp = (cp << 6) | (*s++ & 0x3f);
+
+	*p = s;
+	return cp;
+}
+
+/*
+ * Builds the page table from the unicode table of a PSF2 font. Each glyph
+ * has a list of UTF-8 code points ending with PSF2_SEPARATOR, multi code
+ * point sequences after PSF2_START_SEQUENCE are ignored.
+ */
+static int font_parse_unicode(const uint8_t* table, const uint8_t* end,
+			      int count)
+{
+	int capacity = 16;
+
+	face.page_map = calloc(FONT_UNICODE_PAGES, sizeof(*face.page_map));
+	face.pages = malloc(capacity * sizeof(*face.pages));
+	if (!face.page_map || !face.pages)
+		return -ENOMEM;
+	memset(face.pages[0], 0xff, sizeof(face.pages[0]));
+	face.num_pages = 1;
+
+	for (int glyph = 0; glyph < count && table < end; glyph++) {
+		bool sequence = false;
+
+		while (table < end && *table != PSF2_SEPARATOR) {
+			uint32_t cp;
+			int32_t* index;
+
+			if (*table == PSF2_START_SEQUENCE) {
+				sequence = true;
+				table++;
+				continue;
+			}
+
+			cp = font_decode_utf8(&table, end);
+			if (sequence || cp >= FONT_UNICODE_PAGES << 8)
+				continue;
+
+			if (!face.page_map[cp >> 8]) {
+				if (face.num_pages == capacity) {
+					void* pages = realloc(face.pages,
+						2 * capacity * sizeof(*face.pages));
+					if (!pages)
+						return -ENOMEM;
+					face.pages = pages;
+					capacity *= 2;
+				}
+				memset(face.pages[face.num_pages], 0xff,
+				       sizeof(face.pages[0]));
+				face.page_map[cp >> 8] = face.num_pages++;
+			}
+
+			index = &face.pages[face.page_map[cp >> 8]][cp & 0xff];
+			if (*index < 0)
+				*index = glyph;
+		}
+		table++;
+	}
+
+	return 0;
+}
+
+static void font_unload(void)
 {
-	int glyph_count = sizeof(glyphs) / (GLYPH_BYTES_PER_ROW * GLYPH_HEIGHT);
+	if (face.map)
+		munmap(face.map, face.map_size);
+	free(face.page_map);
+	free(face.pages);
+	face.map = NULL;
+	face.page_map = NULL;
+	face.pages = NULL;
+	face.num_pages = 0;
+	face.width = GLYPH_WIDTH;
+	face.height = GLYPH_HEIGHT;
+	face.bytes_per_row = GLYPH_BYTES_PER_ROW;
+	face.count = GLYPH_COUNT;
+	face.glyphs = glyphs[0];
+	face.space_blank = true;
+	glyph_cache_flush();
+}
+
+/*
+ * Use the PSF2 font at |path| instead of the built-in one. The file is
+ * mapped, not read, so large fonts only cost memory for the glyphs that
+ * are drawn. Has to be called before the font is first used.
+ */
+int font_load(const char* path)
+{
+	struct psf2_header header;
+	const uint8_t* data;
+	uint64_t glyphs_end;
+	struct stat st;
+	int32_t space;
+	int fd, ret;
+
+	if (font_ref > 0) {
+		LOG(ERROR, "The font cannot be changed while it is in use.");
+		return -EBUSY;
+	}
 
-	glyph_size = GLYPH_BYTES_PER_ROW * GLYPH_HEIGHT * scaling * scaling;
-	if (!prescaled_glyphs)
-		prescaled_glyphs = (uint8_t*)calloc(glyph_count, glyph_size);
-	for (int i = 0; i < glyph_count; i++) {
-		const uint8_t* src_glyph = glyphs[i];
-		uint8_t* dst_glyph = &prescaled_glyphs[i * glyph_size];
-		scale_glyph(dst_glyph, src_glyph, scaling);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ret = -errno;
+		LOG(ERROR, "Unable to open font %s: %s", path, strerror(-ret));
+		return ret;
 	}
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(header)) {
+		LOG(ERROR, "Font %s is not a PSF2 font.", path);
+		close(fd);
+		return -EINVAL;
+	}
+
+	font_unload();
+	face.map_size = st.st_size;
+	face.map = mmap(NULL, face.map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (face.map == MAP_FAILED) {
+		ret = -errno;
+		LOG(ERROR, "Unable to map font %s: %s", path, strerror(-ret));
+		face.map = NULL;
+		close(fd);
+		return ret;
+	}
+	close(fd);
+
+	data = face.map;
+	memcpy(&header, data, sizeof(header));
+	glyphs_end = (uint64_t)header.header_size +
+		(uint64_t)header.length * header.charsize;
+	if (header.magic != PSF2_MAGIC ||
+	    header.header_size < sizeof(header) ||
+	    header.length == 0 || header.length > INT32_MAX ||
+	    header.width == 0 || header.width > FONT_MAX_GLYPH_SIZE ||
+	    header.height == 0 || header.height > FONT_MAX_GLYPH_SIZE ||
+	    header.charsize != header.height * ((header.width + 7) / 8) ||
+	    glyphs_end > face.map_size) {
+		LOG(ERROR, "Font %s is not a valid PSF2 font.", path);
+		font_unload();
+		return -EINVAL;
+	}
+
+	face.width = header.width;
+	face.height = header.height;
+	face.bytes_per_row = (header.width + 7) / 8;
+	face.count = header.length;
+	face.glyphs = data + header.header_size;
+
+	if (header.flags & PSF2_HAS_UNICODE_TABLE) {
+		ret = font_parse_unicode(data + glyphs_end,
+					 data + face.map_size, face.count);
+		if (ret < 0) {
+			LOG(ERROR, "Out of memory for the glyph table of %s.",
+			    path);
+			font_unload();
+			return ret;
+		}
+	}
+
+	/* Cells holding a space are drawn as blank ones if it looks that way. */
+	space = face_glyph_index(' ');
+	if (space >= 0) {
+		const uint8_t* glyph = &face.glyphs[space * header.charsize];
+
+		for (uint32_t i = 0; i < header.charsize; i++)
+			if (glyph[i])
+				face.space_blank = false;
+	}
+
+	/* Cached glyphs are from the old font. */
+	glyph_cache_flush();
+
+	LOG(INFO, "Using font %s, %d glyphs of %dx%d.", path, face.count,
+	    face.width, face.height);
+	return 0;
+}
+
+bool font_space_is_blank(void)
+{
+	return face.space_blank;
+}
+
+static expand_row_t select_expand_row(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return expand_row_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return expand_row_sse2;
+#elif defined(__ARM_NEON)
+	return expand_row_neon;
+#endif
+	return expand_row_scalar;
 }
 
 void font_init(int scaling)
 {
 	if (font_ref == 0) {
-		font_scaling = scaling;
-		if (scaling > 1) {
-			prescale_font(scaling);
+		expand_row = select_expand_row();
+		/* Fonts taller than the built-in one need less scaling. */
+		if (face.height > GLYPH_HEIGHT)
+			scaling = MAX(1, scaling * GLYPH_HEIGHT / face.height);
+		if (scaling > FONT_MAX_SCALING) {
+			LOG(WARNING, "Font scaling %d is too large, using %d.",
+			    scaling, FONT_MAX_SCALING);
+			scaling = FONT_MAX_SCALING;
+		}
+		glyph_size = face.bytes_per_row * face.height *
+			scaling * scaling;
+		if (scaling > 1 && prepare_scaling(scaling) < 0) {
+			scaling = 1;
+			glyph_size = face.bytes_per_row * face.height;
 		}
+		font_scaling = scaling;
+		if (glyph_cache.scaling != scaling)
+			glyph_cache_flush();
 	}
 	font_ref++;
 }
@@ -164,60 +780,129 @@ void font_free()
 {
 	font_ref--;
 	if (font_ref == 0) {
-		if (prescaled_glyphs) {
-			free(prescaled_glyphs);
-			prescaled_glyphs = NULL;
-		}
+		free(scaled_glyphs);
+		free(glyph_scaled);
+		baked_glyphs = NULL;
+		scaled_glyphs = NULL;
+		glyph_scaled = NULL;
 	}
 }
 
 void font_get_size(uint32_t* char_width, uint32_t* char_height)
 {
-	*char_width = GLYPH_WIDTH * font_scaling;
-	*char_height = GLYPH_HEIGHT * font_scaling;
+	*char_width = face.width * font_scaling;
+	*char_height = face.height * font_scaling;
 }
 
-void font_fillchar(uint32_t* dst_pointer, int dst_char_x, int dst_char_y,
-		   int32_t pitch, uint32_t front_color, uint32_t back_color)
+void font_fill_span(uint32_t* dst_pointer, int dst_char_x, int dst_char_y,
+		    int32_t pitch, int count, uint32_t back_color)
 {
-	int dst_x = dst_char_x * GLYPH_WIDTH * font_scaling;
-	int dst_y = dst_char_y * GLYPH_HEIGHT * font_scaling;
+	int dst_x = dst_char_x * face.width * font_scaling;
+	int dst_y = dst_char_y * face.height * font_scaling;
+	int width = count * face.width * font_scaling;
+	uint32_t* dst = dst_pointer + dst_y * (pitch / 4) + dst_x;
 
-	for (int j = 0; j < GLYPH_HEIGHT * font_scaling; j++)
-		for (int i = 0; i < GLYPH_WIDTH * font_scaling; i++)
-			dst_pointer[dst_x + i + (dst_y + j) * pitch / 4] =
-			    back_color;
+	for (int j = 0; j < face.height * font_scaling; j++, dst += pitch / 4)
+		for (int i = 0; i < width; i++)
+			dst[i] = back_color;
 }
 
-void font_render(uint32_t* dst_pointer, int dst_char_x, int dst_char_y,
-		 int32_t pitch, uint32_t ch, uint32_t front_color,
-		 uint32_t back_color)
+static int32_t font_glyph_index(uint32_t ch)
 {
-	int dst_x = dst_char_x * GLYPH_WIDTH * font_scaling;
-	int dst_y = dst_char_y * GLYPH_HEIGHT * font_scaling;
-	int32_t glyph_index = code_point_to_glyph_index(ch);
+	int32_t glyph_index = face_glyph_index(ch);
 
-	if (glyph_index < 0) {
-		glyph_index = code_point_to_glyph_index(
+	if (glyph_index < 0)
+		glyph_index = face_glyph_index(
 			UNICODE_REPLACEMENT_CHARACTER_CODE_POINT);
-		if (glyph_index < 0) {
-			return;
-		}
-	}
+	if (glyph_index < 0)
+		glyph_index = face_glyph_index('?');
+	return glyph_index;
+}
 
+static const uint8_t* font_glyph_row(int32_t glyph_index, int row)
+{
 	const uint8_t* glyph;
+
 	if (font_scaling == 1) {
-		glyph = glyphs[glyph_index];
+		glyph = &face.glyphs[glyph_index * glyph_size];
+	} else if (baked_glyphs) {
+		glyph = &baked_glyphs[glyph_index * glyph_size];
 	} else {
-		glyph = &prescaled_glyphs[glyph_index * glyph_size];
+		glyph = scaled_glyph(glyph_index);
 	}
+	return &glyph[row * face.bytes_per_row * font_scaling];
+}
+
+#define FONT_SPAN_CHUNK 64
 
-	for (int j = 0; j < GLYPH_HEIGHT * font_scaling; j++) {
-		const uint8_t* src_row =
-			&glyph[j * GLYPH_BYTES_PER_ROW * font_scaling];
-		for (int i = 0; i < GLYPH_WIDTH * font_scaling; i++) {
-			dst_pointer[dst_x + i + (dst_y + j) * pitch / 4] =
-				get_bit(src_row, i) ? front_color : back_color;
+static void font_render_chunk(uint32_t* dst, int32_t pitch,
+			      const uint32_t* chars, int count,
+			      uint32_t front_color, uint32_t back_color)
+{
+	int width = face.width * font_scaling;
+	int height = face.height * font_scaling;
+	int32_t glyph_index[FONT_SPAN_CHUNK];
+	glyph_cache_entry_t* entry[FONT_SPAN_CHUNK];
+	/*
+	 * Entries used by this chunk are the most recently used ones, so as
+	 * long as the chunk fits in the cache none of them can be recycled
+	 * while the rest of the chunk is looked up.
+	 */
+	bool use_cache = count <= glyph_cache.max_entries;
+
+	for (int i = 0; i < count; i++) {
+		glyph_index[i] = font_glyph_index(chars[i]);
+		entry[i] = NULL;
+		if (glyph_index[i] < 0 || !use_cache)
+			continue;
+
+		entry[i] = glyph_cache_lookup(glyph_index[i],
+					      front_color, back_color);
+		if (entry[i])
+			continue;
+
+		entry[i] = glyph_cache_insert(glyph_index[i],
+					      front_color, back_color);
+		if (!entry[i])
+			continue;
+		for (int j = 0; j < height; j++)
+			expand_row(&entry[i]->pixels[j * width],
+				   font_glyph_row(glyph_index[i], j), width,
+				   front_color, back_color);
+	}
+
+	/* Write whole framebuffer rows at a time. */
+	for (int j = 0; j < height; j++, dst += pitch / 4) {
+		uint32_t* cell = dst;
+		for (int i = 0; i < count; i++, cell += width) {
+			if (entry[i])
+				memcpy(cell, &entry[i]->pixels[j * width],
+				       width * sizeof(uint32_t));
+			else if (glyph_index[i] >= 0)
+				expand_row(cell,
+					   font_glyph_row(glyph_index[i], j),
+					   width, front_color, back_color);
+			else
+				for (int k = 0; k < width; k++)
+					cell[k] = back_color;
 		}
 	}
 }
+
+void font_render_span(uint32_t* dst_pointer, int dst_char_x, int dst_char_y,
+		      int32_t pitch, const uint32_t* chars, int count,
+		      uint32_t front_color, uint32_t back_color)
+{
+	int dst_y = dst_char_y * face.height * font_scaling;
+
+	while (count > 0) {
+		int n = MIN(count, FONT_SPAN_CHUNK);
+		int dst_x = dst_char_x * face.width * font_scaling;
+
+		font_render_chunk(dst_pointer + dst_y * (pitch / 4) + dst_x,
+				  pitch, chars, n, front_color, back_color);
+		chars += n;
+		dst_char_x += n;
+		count -= n;
+	}
+}
@@ -7,13 +7,20 @@
 #ifndef FONT_H
 #define FONT_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 void font_init(int scaling);
 void font_free();
-void font_fillchar(uint32_t* dst_pointer, int dst_char_x, int dst_char_y,
-		   int32_t pitch, uint32_t front_color, uint32_t back_color);
-void font_render(uint32_t* dst_pointer, int dst_char_x, int dst_char_y,
-		 int32_t pitch, uint32_t ch, uint32_t front_color,
-		 uint32_t back_color);
+void font_set_cache_size(size_t size);
+int font_load(const char* path);
+bool font_space_is_blank(void);
+void font_fill_span(uint32_t* dst_pointer, int dst_char_x, int dst_char_y,
+		    int32_t pitch, int count, uint32_t back_color);
+void font_render_span(uint32_t* dst_pointer, int dst_char_x, int dst_char_y,
+		      int32_t pitch, const uint32_t* chars, int count,
+		      uint32_t front_color, uint32_t back_color);
 void font_get_size(uint32_t* char_width, uint32_t* char_height);
 
 #endif
@@ -10,6 +10,43 @@ from __future__ import print_function
 import re
 import sys
 
+# Scales that get a table of glyphs prescaled at build time. Other scales
+# are scaled at runtime by font.c, which uses the same algorithm.
+PRESCALED_SCALES = (2, 3, 4)
+
+# Bitmasks of the neighbor pixels passed to ScalePixel().
+NW, N, NE = 1 << 8, 1 << 7, 1 << 6
+W, C, E = 1 << 5, 1 << 4, 1 << 3
+SW, S, SE = 1 << 2, 1 << 1, 1 << 0
+
+
+def ScalePixel(neighbors, sx, sy, scaling):
+  """Returns the subpixel (sx, sy) of a pixel scaled by |scaling|.
+
+  This must match scale_pixel() in font.c, see there for the rules.
+  """
+  def Is(mask, value):
+    return (neighbors & mask) == value
+
+  if neighbors & C:
+    last = scaling - 1
+    return int(not (
+        (sx == 0 and sy == 0 and
+         (Is(S|SW|W|NW|N|NE, S|NE) or Is(E|NE|N|NW|W|SW, E|SW))) or
+        (sx == last and sy == 0 and
+         (Is(W|NW|N|NE|E|SE, W|SE) or Is(S|SE|E|NE|N|NW, S|NW))) or
+        (sx == 0 and sy == last and
+         (Is(N|NW|W|SW|S|SE, N|SE) or Is(E|SE|S|SW|W|NW, E|NW))) or
+        (sx == last and sy == last and
+         (Is(N|NE|E|SE|S|SW, N|SW) or Is(W|SW|S|SE|E|NE, W|NE)))))
+  return int(not Is(N|W|E|S, N|W|E|S) and (
+      (sx < sy and Is(W|S, W|S) and (Is(SW, 0) or Is(NW|SE, 0))) or
+      (sy < sx and Is(N|E, N|E) and (Is(NE, 0) or Is(NW|SE, 0))) or
+      (sx + sy > scaling - 1 and Is(E|S, E|S) and
+       (Is(SE, 0) or Is(NE|SW, 0))) or
+      (sx + sy < scaling - 1 and Is(N|W, N|W) and
+       (Is(NW, 0) or Is(NE|SW, 0)))))
+
 
 class GlyphSet(object):
   """Collects glyph bitmap data and outputs it into C source code"""
@@ -44,14 +81,53 @@ class GlyphSet(object):
 
     self.glyph_map[code_point] = data
 
+  def GetPixel(self, data, x, y):
+    if x < 0 or x >= self.width or y < 0 or y >= self.height:
+      return 0
+    return (data[y * self.bytes_per_row + x // 8] >> (7 - x % 8)) & 1
+
+  def ScaleGlyph(self, data, scaling, lut):
+    """Returns the bitmap of a glyph scaled by |scaling|.
+
+    Rows of the result are self.bytes_per_row * scaling bytes long. |lut|
+    holds the result of ScalePixel() for every (neighbors, sx, sy).
+    """
+    row_bytes = self.bytes_per_row * scaling
+    out = [0] * (row_bytes * self.height * scaling)
+    for y in range(self.height):
+      for x in range(self.width):
+        neighbors = 0
+        for dy in (-1, 0, 1):
+          for dx in (-1, 0, 1):
+            neighbors = (neighbors << 1) | self.GetPixel(data, x + dx, y + dy)
+        for sy in range(scaling):
+          for sx in range(scaling):
+            if lut[neighbors][sy][sx]:
+              bit = x * scaling + sx
+              out[(y * scaling + sy) * row_bytes + bit // 8] |= (
+                  0x80 >> (bit % 8))
+    return out
+
+  def WriteGlyphTable(self, out_file, name, glyph_size, glyph_data):
+    out_file.write('static const uint8_t %s[%s][%s] = {\n' %
+                   (name, len(glyph_data), glyph_size))
+    for data in glyph_data:
+      out_file.write('  {')
+      for data_idx in range(glyph_size):
+        out_file.write('0x{:02x}, '.format(data[data_idx]))
+      out_file.write('},\n')
+    out_file.write('};\n')
+
   def ToCSource(self, out_file):
     """Writes this GlyphSet's data into a C source file.
 
     The data written includes:
       - the global dimensions of the glyphs
       - the glyph bitmaps, stored in an array
+      - the glyph bitmaps prescaled by each of PRESCALED_SCALES, and an
+          array of them indexed by the scale
       - a function to convert code points to the index of the glyph in the
-          bitmap array
+          bitmap array, using a two level table of pages of 256 code points
 
     The C source file outputs static data and methods and is intended to be
     #include'd by a compilation unit.
@@ -73,45 +149,70 @@ class GlyphSet(object):
 
     sorted_glyphs = sorted(self.glyph_map.items())
 
-    breaks = []
-    last_code_point = None
+    # Two level lookup: the page of a code point (cp >> 8) selects a table
+    # of 256 glyph indices. Pages without glyphs share table 0.
+    page_tables = [[-1] * 256]
+    page_map = [0] * ((sorted_glyphs[-1][0] >> 8) + 1)
     for glyph_index, (code_point, _) in enumerate(sorted_glyphs):
-      if last_code_point is None or (last_code_point + 1) != code_point:
-        breaks.append((code_point, glyph_index))
-
-      last_code_point = code_point
-
-    breaks.append((None, len(sorted_glyphs)))
-
-    out_file.write('static int32_t code_point_to_glyph_index(uint32_t cp)\n{\n')
-    for break_idx, (this_break_code_point,
-                    this_break_glyph_index) in enumerate(breaks[:-1]):
-      this_break_code_point, this_break_glyph_index = breaks[break_idx]
-      next_break_glyph_index = breaks[break_idx + 1][1]
-      this_break_range = next_break_glyph_index - this_break_glyph_index
-      out_file.write('  if (cp < %s) {\n' %
-                     (this_break_code_point + this_break_range))
-      if this_break_range == 1:
-        out_file.write('    if (cp == %s)\n' % this_break_code_point)
-        out_file.write('      return %s;\n' % this_break_glyph_index)
-      else:
-        out_file.write('    if (cp >= %s)\n' % this_break_code_point)
-        out_file.write('      return cp - %s;\n' %
-                       (this_break_code_point - this_break_glyph_index))
-      out_file.write('    else\n')
-      out_file.write('      return -1;\n')
-      out_file.write('  }\n')
+      page = code_point >> 8
+      if not page_map[page]:
+        page_map[page] = len(page_tables)
+        page_tables.append([-1] * 256)
+      page_tables[page_map[page]][code_point & 0xff] = glyph_index
+
+    index_type = 'int16_t' if len(sorted_glyphs) < (1 << 15) else 'int32_t'
+    page_type = 'uint8_t' if len(page_tables) <= (1 << 8) else 'uint16_t'
+
+    out_file.write('#define GLYPH_PAGES %s\n\n' % len(page_map))
+    out_file.write('static const %s glyph_page_map[GLYPH_PAGES] = {\n' %
+                   page_type)
+    for start in range(0, len(page_map), 16):
+      out_file.write('  %s,\n' %
+                     ', '.join(str(p) for p in page_map[start:start + 16]))
+    out_file.write('};\n\n')
+
+    out_file.write('static const %s glyph_pages[%s][256] = {\n' %
+                   (index_type, len(page_tables)))
+    for table in page_tables:
+      out_file.write('  {\n')
+      for start in range(0, 256, 16):
+        out_file.write('    %s,\n' %
+                       ', '.join(str(i) for i in table[start:start + 16]))
+      out_file.write('  },\n')
+    out_file.write('};\n\n')
+
+    out_file.write('''static int32_t code_point_to_glyph_index(uint32_t cp)
+{
+  if (cp >= GLYPH_PAGES << 8)
+    return -1;
+  return glyph_pages[glyph_page_map[cp >> 8]][cp & 0xff];
+}
+
+''')
+
+    glyph_data = [data for _, data in sorted_glyphs]
+    self.WriteGlyphTable(out_file, 'glyphs', self.glyph_size, glyph_data)
+
+    for scaling in PRESCALED_SCALES:
+      lut = [[[ScalePixel(neighbors, sx, sy, scaling)
+               for sx in range(scaling)]
+              for sy in range(scaling)]
+             for neighbors in range(1 << 9)]
       out_file.write('\n')
-    out_file.write('  return -1;\n')
-    out_file.write('}\n\n')
-
-    out_file.write('static const uint8_t glyphs[%s][%s] = {\n' %
-                   (len(self.glyph_map), self.glyph_size))
-    for code_point, data in sorted_glyphs:
-      out_file.write('  {')
-      for data_idx in range(self.glyph_size):
-        out_file.write('0x{:02x}, '.format(data[data_idx]))
-      out_file.write('},\n')
+      self.WriteGlyphTable(out_file, 'glyphs_%sx' % scaling,
+                           self.glyph_size * scaling * scaling,
+                           [self.ScaleGlyph(data, scaling, lut)
+                            for data in glyph_data])
+
+    max_scaling = max(PRESCALED_SCALES)
+    out_file.write('\n#define GLYPH_MAX_PRESCALED %s\n\n' % max_scaling)
+    out_file.write('static const uint8_t* const '
+                   'prescaled_glyphs[GLYPH_MAX_PRESCALED + 1] = {\n')
+    for scaling in range(max_scaling + 1):
+      if scaling in PRESCALED_SCALES:
+        out_file.write('  glyphs_%sx[0],\n' % scaling)
+      else:
+        out_file.write('  NULL,\n')
     out_file.write('};\n')
 
 
@@ -197,10 +197,10 @@ int image_show(image_t* image, fb_t* fb)
 	pitch4 = fb_getpitch(fb) / 4;
 
 	if (startx >= fb_getwidth(fb) || startx + w <= 0)
-		return 0;
+		goto done;
 
 	if (starty >= fb_getheight(fb) || starty + h <= 0)
-		return 0;
+		goto done;
 
 	if (startx < 0) {
 		ox = -startx;
@@ -230,7 +230,9 @@ int image_show(image_t* image, fb_t* fb)
 			o[x] = i[ix];
 		}
 	}
+	fb_damage(fb, startx, starty, w, h);
 
+done:
 	fb_unlock(fb);
 	return 0;
 }
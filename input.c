@@ -8,20 +8,26 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <libudev.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
 #include <unistd.h>
 
 #include "dbus.h"
 #include "dbus_interface.h"
+#include "event.h"
 #include "input.h"
 #include "keysym.h"
 #include "main.h"
 #include "util.h"
 
+/* Events drained from a device with one read(). */
+#define INPUT_EVENT_BATCH  64
+/* Devices checked by input_pending(). */
+#define INPUT_MAX_POLL     8
+
 struct input_key_event {
 	uint16_t code;
 	unsigned char value;
@@ -30,6 +36,7 @@ struct input_key_event {
 struct input_dev {
 	int fd;
 	char* path;
+	event_source_t* source;
 };
 
 struct keyboard_state {
@@ -262,6 +269,92 @@ static void input_get_keysym_and_unicode(struct input_key_event* event,
 	*unicode = *keysym;
 }
 
+#define BITS_PER_LONG (sizeof(long) * 8)
+#define BITS_TO_LONGS(bits) (((bits) - 1) / BITS_PER_LONG + 1)
+#define BITMASK_GET_BIT(bitmask, bit) \
+    ((bitmask[bit / BITS_PER_LONG] >> (bit % BITS_PER_LONG)) & 1)
+
+static const int kMaxBit = MAX(MAX(EV_MAX, KEY_MAX), SW_MAX);
+
+static bool has_event_bit(int fd, int event_type, int bit)
+{
+	unsigned long bitmask[BITS_TO_LONGS(kMaxBit+1)];
+	memset(bitmask, 0, sizeof(bitmask));
+
+	if (ioctl(fd, EVIOCGBIT(event_type, sizeof(bitmask)), bitmask) < 0)
+		return false;
+
+	return BITMASK_GET_BIT(bitmask, bit);
+}
+
+static int get_switch_bit(int fd, int bit) {
+	unsigned long bitmask[BITS_TO_LONGS(SW_MAX+1)];
+	memset(bitmask, 0, sizeof(bitmask));
+	if (ioctl(fd, EVIOCGSW(sizeof(bitmask)), bitmask) < 0)
+		return -1;
+
+	return BITMASK_GET_BIT(bitmask, bit);
+}
+
+static bool is_lid_switch(int fd)
+{
+	return has_event_bit(fd, 0, EV_SW) && has_event_bit(fd, EV_SW, SW_LID);
+}
+
+/*
+ * Only keyboards and lid switches are of interest, anything else would
+ * just wake frecon up to have its events thrown away. A keyboard has at
+ * least one key of the main block, KEY_ESC to KEY_D.
+ */
+static bool is_keyboard(int fd)
+{
+	unsigned long bitmask[BITS_TO_LONGS(KEY_MAX+1)];
+
+	if (!has_event_bit(fd, 0, EV_KEY))
+		return false;
+
+	memset(bitmask, 0, sizeof(bitmask));
+	if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(bitmask)), bitmask) < 0)
+		return false;
+
+	for (int key = KEY_ESC; key <= KEY_D; key++)
+		if (BITMASK_GET_BIT(bitmask, key))
+			return true;
+	return false;
+}
+
+/*
+ * Where the kernel supports it have evdev drop everything but keys and
+ * switches, and buttons of combined devices, before they reach us.
+ */
+static void input_set_mask(int fd)
+{
+#ifdef EVIOCSMASK
+	unsigned long types[BITS_TO_LONGS(EV_MAX+1)];
+	unsigned long keys[BITS_TO_LONGS(KEY_MAX+1)];
+	struct input_mask mask;
+
+	memset(types, 0, sizeof(types));
+	types[EV_KEY / BITS_PER_LONG] |= 1UL << (EV_KEY % BITS_PER_LONG);
+	types[EV_SW / BITS_PER_LONG] |= 1UL << (EV_SW % BITS_PER_LONG);
+	mask.type = 0;
+	mask.codes_size = sizeof(types);
+	mask.codes_ptr = (uintptr_t)types;
+	if (ioctl(fd, EVIOCSMASK, &mask) < 0)
+		return;
+
+	memset(keys, 0, sizeof(keys));
+	for (int key = 0; key < BTN_MISC; key++)
+		keys[key / BITS_PER_LONG] |= 1UL << (key % BITS_PER_LONG);
+	mask.type = EV_KEY;
+	mask.codes_size = sizeof(keys);
+	mask.codes_ptr = (uintptr_t)keys;
+	ioctl(fd, EVIOCSMASK, &mask);
+#endif
+}
+
+static void input_dev_event(uint32_t events, void* data);
+
 int input_add(const char* devname)
 {
 	int ret = 0, fd = -1;
@@ -284,6 +377,13 @@ int input_add(const char* devname)
 	if (fd < 0)
 		goto errorret;
 
+	if (!is_keyboard(fd) && !is_lid_switch(fd)) {
+		LOG(INFO, "Ignoring input device %s, not a keyboard or lid switch",
+		    devname);
+		ret = -ENODEV;
+		goto closefd;
+	}
+
 	ret = ioctl(fd, EVIOCGRAB, (void*) 1);
 	if (!ret) {
 		ret = ioctl(fd, EVIOCGRAB, (void*) 0);
@@ -310,8 +410,19 @@ int input_add(const char* devname)
 		ret = -ENOMEM;
 		goto closefd;
 	}
+	/* |devs| moves around, so the callback looks the device up by fd. */
+	input.devs[input.ndevs].source =
+		event_add(fd, EPOLLIN, input_dev_event, (void*)(intptr_t)fd);
+	if (!input.devs[input.ndevs].source) {
+		free(input.devs[input.ndevs].path);
+		ret = -ENOMEM;
+		goto closefd;
+	}
+	event_set_priority(input.devs[input.ndevs].source, true);
 	input.ndevs++;
 
+	input_set_mask(fd);
+
 	return fd;
 
 closefd:
@@ -329,6 +440,7 @@ void input_remove(const char* devname)
 
 	for (u = 0; u < input.ndevs; u++) {
 		if (!strcmp(devname, input.devs[u].path)) {
+			event_remove(input.devs[u].source);
 			free(input.devs[u].path);
 			close(input.devs[u].fd);
 			input.ndevs--;
@@ -352,6 +464,7 @@ void input_close()
 	unsigned int u;
 
 	for (u = 0; u < input.ndevs; u++) {
+		event_remove(input.devs[u].source);
 		free(input.devs[u].path);
 		close(input.devs[u].fd);
 	}
@@ -360,121 +473,103 @@ void input_close()
 	input.ndevs = 0;
 }
 
-void input_add_fds(fd_set* read_set, fd_set* exception_set, int *maxfd)
+/*
+ * Handle one key event. Returns true if it went to the active terminal
+ * as user input.
+ */
+static bool input_key(struct input_key_event* event)
 {
-	unsigned int u;
+	terminal_t* terminal;
+	uint32_t keysym, unicode;
 
-	for (u = 0; u < input.ndevs; u++) {
-		FD_SET(input.devs[u].fd, read_set);
-		FD_SET(input.devs[u].fd, exception_set);
-		if (input.devs[u].fd > *maxfd)
-			*maxfd = input.devs[u].fd;
-	}
+	if (input_special_key(event) || !event->value)
+		return false;
+
+	// current_terminal can possibly change during
+	// execution of input_special_key
+	terminal = term_get_current_terminal();
+	if (!term_is_active(terminal))
+		return false;
+
+	input_get_keysym_and_unicode(event, &keysym, &unicode);
+	term_key_event(terminal, keysym, unicode);
+	return true;
 }
 
-struct input_key_event* input_get_event(fd_set* read_set,
-					fd_set* exception_set)
+/*
+ * Drain whatever |fd| has queued with a single read(). The batch lives on
+ * the stack, user activity is reported and the lid handled once for the
+ * whole batch, and the terminal redraw is coalesced by term_key_event().
+ */
+static void input_dev_event(uint32_t events, void* data)
 {
+	struct input_event ev[INPUT_EVENT_BATCH];
+	int fd = (int)(intptr_t)data;
+	bool activity = false;
+	bool lid = false;
 	unsigned int u;
-	struct input_event ev;
-	int ret;
+	ssize_t ret;
+	int n;
 
-	for (u = 0; u < input.ndevs; u++) {
-		if (FD_ISSET(input.devs[u].fd, read_set)
-		    && !FD_ISSET(input.devs[u].fd, exception_set)) {
-			ret =
-			    read(input.devs[u].fd, &ev, sizeof (struct input_event));
-			if (ret < 0) {
-				if (errno == EINTR || errno == EAGAIN)
-					continue;
-				if (errno != ENODEV) {
-					LOG(ERROR, "read: %s: %s", input.devs[u].path,
-						strerror(errno));
-				}
-				input_remove(input.devs[u].path);
-				return NULL;
-			} else if (ret < (int) sizeof (struct input_event)) {
-				LOG(ERROR, "expected %d bytes, got %d",
-				       (int) sizeof (struct input_event), ret);
-				return NULL;
-			}
+	for (u = 0; u < input.ndevs; u++)
+		if (input.devs[u].fd == fd)
+			break;
+	if (u == input.ndevs)
+		return;
 
-			if (ev.type == EV_KEY) {
-				struct input_key_event* event =
-				    malloc(sizeof (*event));
-				event->code = ev.code;
-				event->value = ev.value;
-				return event;
-			} else if (ev.type == EV_SW && ev.code == SW_LID) {
-				/* TODO(dbehr), abstract this in input_key_event if we ever parse more than one */
-				term_monitor_hotplug();
-			}
+	ret = read(fd, ev, sizeof (ev));
+	if (ret < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return;
+		if (errno != ENODEV) {
+			LOG(ERROR, "read: %s: %s", input.devs[u].path,
+				strerror(errno));
 		}
+		input_remove(input.devs[u].path);
+		return;
+	} else if (ret % sizeof (struct input_event)) {
+		LOG(ERROR, "expected a multiple of %d bytes, got %d",
+		       (int) sizeof (struct input_event), (int) ret);
+		return;
 	}
 
-	return NULL;
-}
-
-void input_put_event(struct input_key_event* event)
-{
-	free(event);
-}
-
-void input_dispatch_io(fd_set* read_set, fd_set* exception_set)
-{
-	terminal_t* terminal;
-	struct input_key_event* event;
-
-	event = input_get_event(read_set, exception_set);
-	if (event) {
-		if (!input_special_key(event) && event->value) {
-			uint32_t keysym, unicode;
-			// current_terminal can possibly change during
-			// execution of input_special_key
-			terminal = term_get_current_terminal();
-			if (term_is_active(terminal)) {
-				// Only report user activity when the terminal is active
-				dbus_report_user_activity(USER_ACTIVITY_OTHER);
-				input_get_keysym_and_unicode(
-					event, &keysym, &unicode);
-				term_key_event(terminal,
-						keysym, unicode);
-			}
+	n = ret / sizeof (struct input_event);
+	for (int i = 0; i < n; i++) {
+		if (ev[i].type == EV_KEY) {
+			struct input_key_event event = {
+				.code = ev[i].code,
+				.value = ev[i].value,
+			};
+			activity |= input_key(&event);
+		} else if (ev[i].type == EV_SW && ev[i].code == SW_LID) {
+			/* TODO(dbehr), abstract this in input_key_event if we ever parse more than one */
+			lid = true;
 		}
-		input_put_event(event);
 	}
-}
 
-#define BITS_PER_LONG (sizeof(long) * 8)
-#define BITS_TO_LONGS(bits) (((bits) - 1) / BITS_PER_LONG + 1)
-#define BITMASK_GET_BIT(bitmask, bit) \
-    ((bitmask[bit / BITS_PER_LONG] >> (bit % BITS_PER_LONG)) & 1)
-
-static const int kMaxBit = MAX(MAX(EV_MAX, KEY_MAX), SW_MAX);
-
-static bool has_event_bit(int fd, int event_type, int bit)
-{
-	unsigned long bitmask[BITS_TO_LONGS(kMaxBit+1)];
-	memset(bitmask, 0, sizeof(bitmask));
-
-	if (ioctl(fd, EVIOCGBIT(event_type, sizeof(bitmask)), bitmask) < 0)
-		return false;
-
-	return BITMASK_GET_BIT(bitmask, bit);
+	// Only report user activity when the terminal is active
+	if (activity)
+		dbus_report_user_activity(USER_ACTIVITY_OTHER);
+	if (lid)
+		term_monitor_hotplug();
 }
 
-static int get_switch_bit(int fd, int bit) {
-	unsigned long bitmask[BITS_TO_LONGS(SW_MAX+1)];
-	memset(bitmask, 0, sizeof(bitmask));
-	if (ioctl(fd, EVIOCGSW(sizeof(bitmask)), bitmask) < 0)
-		return -1;
+/*
+ * Returns true if a device has events that were not read yet, so bulk work
+ * like draining a flooding pty can yield to the user.
+ */
+bool input_pending(void)
+{
+	unsigned int n = MIN(input.ndevs, INPUT_MAX_POLL);
+	struct pollfd fds[INPUT_MAX_POLL];
 
-	return BITMASK_GET_BIT(bitmask, bit);
-}
+	for (unsigned int u = 0; u < n; u++) {
+		fds[u].fd = input.devs[u].fd;
+		fds[u].events = POLLIN;
+		fds[u].revents = 0;
+	}
 
-static bool is_lid_switch(int fd)
-{
-	return has_event_bit(fd, 0, EV_SW) && has_event_bit(fd, EV_SW, SW_LID);
+	return n && poll(fds, n, 0) > 0;
 }
 
 int input_check_lid_state(void)
@@ -13,10 +13,9 @@
 
 int input_init();
 void input_close();
-void input_add_fds(fd_set* read_set, fd_set* exception_set, int *maxfd);
-void input_dispatch_io(fd_set* read_set, fd_set* exception_set);
 int input_add(const char* devname);
 void input_remove(const char* devname);
+bool input_pending(void);
 int input_check_lid_state(void);
 
 #endif
@@ -20,8 +20,11 @@
 #include "dbus.h"
 #include "dbus_interface.h"
 #include "dev.h"
+#include "event.h"
+#include "font.h"
 #include "input.h"
 #include "main.h"
+#include "render.h"
 #include "splash.h"
 #include "term.h"
 #include "util.h"
@@ -31,8 +34,10 @@
 #define  FLAG_ENABLE_GFX                   'G'
 #define  FLAG_ENABLE_VT1                   '1'
 #define  FLAG_ENABLE_VTS                   'e'
+#define  FLAG_FONT                         'k'
 #define  FLAG_FRAME_INTERVAL               'f'
 #define  FLAG_GAMMA                        'g'
+#define  FLAG_GLYPH_CACHE                  'K'
 #define  FLAG_HELP                         'h'
 #define  FLAG_IMAGE                        'i'
 #define  FLAG_IMAGE_HIRES                  'I'
@@ -43,9 +48,14 @@
 #define  FLAG_NUM_VTS                      'N'
 #define  FLAG_NO_LOGIN                     'n'
 #define  FLAG_OFFSET                       'O'
+#define  FLAG_PAGE_FLIP                    'F'
+#define  FLAG_PAN_SCROLL                   'r'
 #define  FLAG_PRE_CREATE_VTS               'P'
 #define  FLAG_PRINT_RESOLUTION             'p'
+#define  FLAG_RENDER_THREAD                'R'
 #define  FLAG_SCALE                        'S'
+#define  FLAG_SHADOW_FB                    'w'
+#define  FLAG_SHARED_FB                    'b'
 #define  FLAG_SPLASH_ONLY                  's'
 
 static const struct option command_options[] = {
@@ -55,8 +65,10 @@ static const struct option command_options[] = {
 	{ "enable-gfx", no_argument, NULL, FLAG_ENABLE_GFX },
 	{ "enable-vt1", no_argument, NULL, FLAG_ENABLE_VT1 },
 	{ "enable-vts", no_argument, NULL, FLAG_ENABLE_VTS },
+	{ "font", required_argument, NULL, FLAG_FONT },
 	{ "frame-interval", required_argument, NULL, FLAG_FRAME_INTERVAL },
 	{ "gamma", required_argument, NULL, FLAG_GAMMA },
+	{ "glyph-cache", required_argument, NULL, FLAG_GLYPH_CACHE },
 	{ "help", no_argument, NULL, FLAG_HELP },
 	{ "image", required_argument, NULL, FLAG_IMAGE },
 	{ "image-hires", required_argument, NULL, FLAG_IMAGE_HIRES },
@@ -67,9 +79,14 @@ static const struct option command_options[] = {
 	{ "num-vts", required_argument, NULL, FLAG_NUM_VTS },
 	{ "no-login", no_argument, NULL, FLAG_NO_LOGIN },
 	{ "offset", required_argument, NULL, FLAG_OFFSET },
+	{ "page-flip", no_argument, NULL, FLAG_PAGE_FLIP },
+	{ "pan-scroll", no_argument, NULL, FLAG_PAN_SCROLL },
 	{ "print-resolution", no_argument, NULL, FLAG_PRINT_RESOLUTION },
 	{ "pre-create-vts", no_argument, NULL, FLAG_PRE_CREATE_VTS },
+	{ "render-thread", no_argument, NULL, FLAG_RENDER_THREAD },
 	{ "scale", required_argument, NULL, FLAG_SCALE },
+	{ "shadow-fb", no_argument, NULL, FLAG_SHADOW_FB },
+	{ "shared-fb", no_argument, NULL, FLAG_SHARED_FB },
 	{ "splash-only", no_argument, NULL, FLAG_SPLASH_ONLY },
 	{ NULL, 0, NULL, 0 }
 };
@@ -80,8 +97,10 @@ static const char * const command_help[] = {
 	"Enable image and box drawing OSC escape codes.",
 	"Enable switching to VT1 and keep a terminal on it.",
 	"Enable additional terminals beyond VT1.",
+	"PSF2 font file to use instead of the built-in font.",
 	"Default time (in msecs) between splash animation frames.",
 	"The gamma table to apply. (unimplemented)",
+	"Size (in KiB) of the rendered glyph cache, 0 disables it.",
 	"This help screen!",
 	"Image (low res) to use for splash animation.",
 	"Image (hi res) to use for splash animation.",
@@ -92,9 +111,14 @@ static const char * const command_help[] = {
 	"Number of enabled VTs. The default is 4, the maximum is 12.",
 	"Do not display login prompt on additional VTs.",
 	"Absolute location of the splash image on screen (as x,y).",
+	"Double buffer the screen and present with page flips.",
+	"Scroll by panning a taller framebuffer instead of redrawing.",
 	"(Deprecated) Print detected screen resolution and exit.",
 	"Create all VTs immediately instead of on-demand.",
+	"Draw the terminal text on a separate thread.",
 	"Default scale for splash screen images.",
+	"Draw into cached memory and copy changes to the screen.",
+	"Draw all terminals into one framebuffer to save memory.",
 	"Exit immediately after finishing splash animation.",
 };
 
@@ -149,51 +173,26 @@ int main_process_events(uint32_t usec)
 {
 	terminal_t* terminal;
 	terminal_t* new_terminal;
-	fd_set read_set, exception_set;
-	int maxfd = -1;
-	int sstat;
-	struct timeval tm;
-	struct timeval* ptm;
-
-	terminal = term_get_current_terminal();
-
-	FD_ZERO(&read_set);
-	FD_ZERO(&exception_set);
-
-	dbus_add_fds(&read_set, &exception_set, &maxfd);
-	input_add_fds(&read_set, &exception_set, &maxfd);
-	dev_add_fds(&read_set, &exception_set, &maxfd);
+	int ret;
 
-	for (unsigned i = 0; i < term_num_terminals; i++) {
-		terminal_t* current_term = term_get_terminal(i);
-		if (term_is_valid(current_term))
-			term_add_fds(current_term, &read_set, &exception_set, &maxfd);
+	/*
+	 * All sources live in one epoll set and run their own callbacks, a
+	 * wakeup dispatches every ready source.
+	 */
+	ret = event_dispatch(usec ? (int)(usec / 1000) : -1);
+	if (ret < 0) {
+		LOG(ERROR, "Waiting for events failed: %d", ret);
+		return ret;
 	}
-
-	if (usec) {
-		ptm = &tm;
-		tm.tv_sec = 0;
-		tm.tv_usec = usec;
-	} else
-		ptm = NULL;
-
-	sstat = select(maxfd + 1, &read_set, NULL, &exception_set, ptm);
-	if (sstat == 0)
+	/* Output queued by the terminals goes out once per iteration. */
+	term_flush_writes();
+	if (ret == 0)
 		return 0;
 
 	dbus_dispatch_io();
 
-	if (term_exception(terminal, &exception_set))
-		return -1;
-
-	dev_dispatch_io(&read_set, &exception_set);
-	input_dispatch_io(&read_set, &exception_set);
-
-	for (unsigned i = 0; i < term_num_terminals; i++) {
-		terminal_t* current_term = term_get_terminal(i);
-		if (term_is_valid(current_term))
-			term_dispatch_io(current_term, &read_set);
-	}
+	/* Render once all pending pty data has been fed to the terminals. */
+	term_dispatch_redraw();
 
 	/* Could have changed in input dispatch. */
 	terminal = term_get_current_terminal();
@@ -345,6 +344,34 @@ int main(int argc, char* argv[])
 				command_flags.pre_create_vts = true;
 				break;
 
+			case FLAG_RENDER_THREAD:
+				command_flags.render_thread = true;
+				break;
+
+			case FLAG_PAGE_FLIP:
+				command_flags.page_flip = true;
+				break;
+
+			case FLAG_PAN_SCROLL:
+				command_flags.pan_scroll = true;
+				break;
+
+			case FLAG_SHADOW_FB:
+				command_flags.shadow_fb = true;
+				break;
+
+			case FLAG_SHARED_FB:
+				command_flags.shared_fb = true;
+				break;
+
+			case FLAG_FONT:
+				font_load(optarg);
+				break;
+
+			case FLAG_GLYPH_CACHE:
+				font_set_cache_size(strtoul(optarg, NULL, 0) * 1024);
+				break;
+
 			case FLAG_SPLASH_ONLY:
 				command_flags.splash_only = true;
 				break;
@@ -380,6 +407,12 @@ int main(int argc, char* argv[])
 		}
 	}
 
+	ret = event_init();
+	if (ret) {
+		LOG(ERROR, "Event loop init failed.");
+		return EXIT_FAILURE;
+	}
+
 	ret = input_init();
 	if (ret) {
 		LOG(ERROR, "Input init failed.");
@@ -520,10 +553,12 @@ int main(int argc, char* argv[])
 	ret = main_loop();
 
 main_done:
+	render_close();
 	input_close();
 	dev_close();
 	dbus_destroy();
 	drm_close();
+	event_close();
 	if (command_flags.daemon)
 		unlink(FRECON_PID_FILE);
 
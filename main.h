@@ -21,6 +21,11 @@ typedef struct {
 	bool    enable_gfx;
 	bool    no_login;
 	bool    pre_create_vts;
+	bool    render_thread;
+	bool    page_flip;
+	bool    pan_scroll;
+	bool    shadow_fb;
+	bool    shared_fb;
 } commandflags_t;
 
 extern commandflags_t command_flags;
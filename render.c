@@ -0,0 +1,201 @@
+/*
+ * Copyright 2016 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "render.h"
+#include "util.h"
+
+/*
+ * With --render-thread the framebuffer writes of a frame run on a separate
+ * thread, so a slow (uncached) framebuffer never holds up pty and input
+ * handling. There is at most one job in flight. The main thread fills in
+ * the job and wakes the thread through wake_fd, the thread runs draw() and
+ * signals done_fd, whose event runs done() on the main thread. Everything
+ * else, DRM ioctls included, stays on the main thread.
+ */
+static struct {
+	bool started;
+	pthread_t thread;
+	int wake_fd;
+	int done_fd;
+	event_source_t* done_source;
+	render_cb_t draw;
+	render_cb_t done;
+	void* data;
+	/* Owned by the main thread, set from submit until done() ran. */
+	bool busy;
+	/* Set by the render thread once draw() returned. */
+	int finished;
+	int exit;
+} render = {
+	.wake_fd = -1,
+	.done_fd = -1,
+};
+
+static void render_signal(int fd)
+{
+	uint64_t one = 1;
+
+	while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR)
+		;
+}
+
+static void* render_thread(void* arg)
+{
+	uint64_t count;
+
+	for (;;) {
+		if (read(render.wake_fd, &count, sizeof(count)) < 0) {
+			if (errno == EINTR)
+				continue;
+			LOG(ERROR, "Render thread wakeup failed: %m");
+			break;
+		}
+		if (__atomic_load_n(&render.exit, __ATOMIC_ACQUIRE))
+			break;
+
+		render.draw(render.data);
+		__atomic_store_n(&render.finished, 1, __ATOMIC_RELEASE);
+		render_signal(render.done_fd);
+	}
+
+	return NULL;
+}
+
+/* Finishes the job on the main thread if the render thread is done. */
+static void render_complete(void)
+{
+	uint64_t count;
+
+	if (read(render.done_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		LOG(ERROR, "Reading render completion failed: %m");
+
+	if (!render.busy || !__atomic_load_n(&render.finished, __ATOMIC_ACQUIRE))
+		return;
+
+	render.finished = 0;
+	render.busy = false;
+	render.done(render.data);
+}
+
+static void render_done_event(uint32_t events, void* data)
+{
+	render_complete();
+}
+
+static int render_start(void)
+{
+	sigset_t all, old;
+	int ret;
+
+	render.wake_fd = eventfd(0, EFD_CLOEXEC);
+	render.done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (render.wake_fd < 0 || render.done_fd < 0) {
+		LOG(ERROR, "Failed to create render eventfds: %m");
+		goto fail;
+	}
+
+	render.done_source = event_add(render.done_fd, EPOLLIN,
+				       render_done_event, NULL);
+	if (!render.done_source)
+		goto fail;
+
+	/* Signals are for the main thread only. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&render.thread, NULL, render_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		LOG(ERROR, "Failed to start the render thread: %s", strerror(ret));
+		goto fail;
+	}
+
+	render.started = true;
+	return 0;
+
+fail:
+	if (render.done_source)
+		event_remove(render.done_source);
+	render.done_source = NULL;
+	if (render.wake_fd >= 0)
+		close(render.wake_fd);
+	if (render.done_fd >= 0)
+		close(render.done_fd);
+	render.wake_fd = -1;
+	render.done_fd = -1;
+	return -1;
+}
+
+/*
+ * Run |draw| on the render thread and |done| from the event loop after it.
+ * Returns false if nothing was queued, the caller then draws itself.
+ */
+bool render_submit(render_cb_t draw, render_cb_t done, void* data)
+{
+	if (render.busy)
+		return false;
+
+	if (!render.started && render_start() < 0)
+		return false;
+
+	render.draw = draw;
+	render.done = done;
+	render.data = data;
+	render.busy = true;
+	render_signal(render.wake_fd);
+	return true;
+}
+
+bool render_busy(void)
+{
+	return render.busy;
+}
+
+/*
+ * Block until the job in flight, if any, is done. Everything that touches
+ * the framebuffer or the font outside of a job has to call this first.
+ */
+void render_wait(void)
+{
+	while (render.busy) {
+		struct pollfd pfd = { render.done_fd, POLLIN, 0 };
+
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+			LOG(ERROR, "Waiting for the render thread failed: %m");
+			return;
+		}
+		render_complete();
+	}
+}
+
+void render_close(void)
+{
+	if (!render.started)
+		return;
+
+	render_wait();
+	__atomic_store_n(&render.exit, 1, __ATOMIC_RELEASE);
+	render_signal(render.wake_fd);
+	pthread_join(render.thread, NULL);
+	render.exit = 0;
+
+	event_remove(render.done_source);
+	close(render.wake_fd);
+	close(render.done_fd);
+	render.done_source = NULL;
+	render.wake_fd = -1;
+	render.done_fd = -1;
+	render.started = false;
+}
@@ -0,0 +1,20 @@
+/*
+ * Copyright 2016 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stdbool.h>
+
+/* Runs on the render thread (draw) or from the event loop (done). */
+typedef void (*render_cb_t)(void* data);
+
+bool render_submit(render_cb_t draw, render_cb_t done, void* data);
+bool render_busy(void);
+void render_wait(void);
+void render_close(void);
+
+#endif
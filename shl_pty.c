@@ -21,14 +21,21 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/uio.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "shl_pty.h"
 
 #define SHL_PTY_BUFSIZE 16384
 
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
 /*
  * Ring Buffer
  * Our PTY helper buffers outgoing data so the caller can rely on write
@@ -45,45 +52,196 @@ struct ring {
 	size_t size;
 	size_t start;
 	size_t end;
+	int fd;
+	bool mirrored;
 };
 
 #define RING_MASK(_r, _v) ((_v) & ((_r)->size - 1))
 
 /*
- * Resize ring-buffer to size @nsize. @nsize must be a power-of-2, otherwise
- * ring operations will behave incorrectly.
+ * The ring preferably lives in a memfd that is mapped twice back to back, so
+ * the bytes following buf[size - 1] are buf[0] again. Data that wraps around
+ * the end is still contiguous in memory: every push is a single memcpy() and
+ * every peek a single iovec.
+ * If memfd_create() or mmap() is not available, the ring falls back to a
+ * plain malloc()ed buffer and wrapped data is split into two parts.
  */
-static int ring_resize(struct ring *r, size_t nsize)
+static int ring_memfd(void)
+{
+#ifdef SYS_memfd_create
+	return syscall(SYS_memfd_create, "shl_pty_ring", MFD_CLOEXEC);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/*
+ * Map @r->fd twice, back to back, into @nsize * 2 bytes of address space.
+ * Returns MAP_FAILED on failure.
+ */
+static char *ring_map(struct ring *r, size_t nsize)
+{
+	char *buf, *p;
+
+	/* reserve the address space, then place both views into it */
+	buf = mmap(NULL, 2 * nsize, PROT_NONE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+		return MAP_FAILED;
+
+	p = mmap(buf, nsize, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, r->fd, 0);
+	if (p != MAP_FAILED)
+		p = mmap(buf + nsize, nsize, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_FIXED, r->fd, 0);
+	if (p == MAP_FAILED) {
+		munmap(buf, 2 * nsize);
+		return MAP_FAILED;
+	}
+
+	return buf;
+}
+
+static void ring_release(struct ring *r)
+{
+	if (r->mirrored) {
+		munmap(r->buf, 2 * r->size);
+		close(r->fd);
+	} else {
+		free(r->buf);
+	}
+}
+
+static void ring_free(struct ring *r)
+{
+	if (!r->buf)
+		return;
+
+	ring_release(r);
+	r->buf = NULL;
+	r->size = 0;
+	r->start = 0;
+	r->end = 0;
+	r->mirrored = false;
+}
+
+/*
+ * Get data pointers for current ring-buffer data. @vec must be an array of 2
+ * iovec objects. The number of used iovecs is returned: 0 if the buffer is
+ * empty, 1 if the data is contiguous, 2 if it wraps around the end of a heap
+ * ring. A mirrored ring never needs vec[1].
+ *
+ * Hint: "struct iovec" is defined in <sys/uio.h> and looks like this:
+ *     struct iovec {
+ *         void *iov_base;
+ *         size_t iov_len;
+ *     };
+ */
+static size_t ring_peek(struct ring *r, struct iovec *vec)
+{
+	if (r->end == r->start)
+		return 0;
+
+	if (r->mirrored || r->end > r->start) {
+		vec[0].iov_base = &r->buf[r->start];
+		vec[0].iov_len = RING_MASK(r, r->end - r->start);
+		return 1;
+	}
+
+	vec[0].iov_base = &r->buf[r->start];
+	vec[0].iov_len = r->size - r->start;
+	vec[1].iov_base = r->buf;
+	vec[1].iov_len = r->end;
+	return 2;
+}
+
+/*
+ * Grow a mirrored ring to @nsize, creating the memfd on first use. The data
+ * stays where it is; only if it wraps around the old end, the wrapped head
+ * is copied behind the old end so it follows the tail in the bigger ring.
+ */
+static int ring_resize_mirrored(struct ring *r, size_t nsize)
+{
+	char *buf;
+
+	if (!r->buf) {
+		r->fd = ring_memfd();
+		if (r->fd < 0)
+			return -errno;
+	}
+
+	if (ftruncate(r->fd, nsize) < 0)
+		goto err;
+
+	buf = ring_map(r, nsize);
+	if (buf == MAP_FAILED)
+		goto err;
+
+	if (r->buf)
+		munmap(r->buf, 2 * r->size);
+
+	if (r->end < r->start) {
+		memcpy(&buf[r->size], buf, r->end);
+		r->end += r->size;
+	}
+
+	r->buf = buf;
+	r->size = nsize;
+	r->mirrored = true;
+
+	return 0;
+
+err:
+	if (!r->buf)
+		close(r->fd);
+	return -ENOMEM;
+}
+
+/* Move the ring into a malloc()ed buffer of size @nsize. */
+static int ring_resize_heap(struct ring *r, size_t nsize)
 {
+	struct iovec vec[2];
+	size_t i, num, len = 0;
 	char *buf;
 
 	buf = malloc(nsize);
 	if (!buf)
 		return -ENOMEM;
 
-	if (r->end == r->start) {
-		r->end = 0;
-		r->start = 0;
-	} else if (r->end > r->start) {
-		memcpy(buf, &r->buf[r->start], r->end - r->start);
-
-		r->end -= r->start;
-		r->start = 0;
-	} else {
-		memcpy(buf, &r->buf[r->start], r->size - r->start);
-		memcpy(&buf[r->size - r->start], r->buf, r->end);
-
-		r->end += r->size - r->start;
-		r->start = 0;
+	num = r->buf ? ring_peek(r, vec) : 0;
+	for (i = 0; i < num; ++i) {
+		memcpy(&buf[len], vec[i].iov_base, vec[i].iov_len);
+		len += vec[i].iov_len;
 	}
 
-	free(r->buf);
+	if (r->buf)
+		ring_release(r);
+
 	r->buf = buf;
 	r->size = nsize;
+	r->start = 0;
+	r->end = len;
+	r->mirrored = false;
 
 	return 0;
 }
 
+/*
+ * Resize ring-buffer to size @nsize. @nsize must be a power-of-2 and a
+ * multiple of the page size, otherwise ring operations will behave
+ * incorrectly.
+ * A mirrored ring is tried first; if that fails, the data is moved into a
+ * heap ring, which is kept from then on.
+ */
+static int ring_resize(struct ring *r, size_t nsize)
+{
+	if ((!r->buf || r->mirrored) && ring_resize_mirrored(r, nsize) >= 0)
+		return 0;
+
+	return ring_resize_heap(r, nsize);
+}
+
 /* Compute next higher power-of-2 of @v. Returns 4096 in case v is 0. */
 static size_t ring_pow2(size_t v)
 {
@@ -121,12 +279,14 @@ static int ring_grow(struct ring *r, size_t add)
 		len = r->start + r->size - r->end;
 
 	/* don't use ">=" as "end == start" would be ambigious */
-	if (len > add)
+	if (r->buf && len > add)
 		return 0;
 
 	/* +1 for additional "end == start" byte */
 	len = r->size + add - len + 1;
 	len = ring_pow2(len);
+	if (len < (size_t) sysconf(_SC_PAGESIZE))
+		len = sysconf(_SC_PAGESIZE);
 
 	if (len <= r->size)
 		return -ENOMEM;
@@ -147,7 +307,7 @@ static int ring_push(struct ring *r, const char *u8, size_t len)
 	if (err < 0)
 		return err;
 
-	if (r->start <= r->end) {
+	if (!r->mirrored && r->start <= r->end) {
 		l = r->size - r->end;
 		if (l > len)
 			l = len;
@@ -168,35 +328,6 @@ static int ring_push(struct ring *r, const char *u8, size_t len)
 	return 0;
 }
 
-/*
- * Get data pointers for current ring-buffer data. @vec must be an array of 2
- * iovec objects. They are filled according to the data available in the
- * ring-buffer. 0, 1 or 2 is returned according to the number of iovec objects
- * that were filled (0 meaning buffer is empty).
- *
- * Hint: "struct iovec" is defined in <sys/uio.h> and looks like this:
- *     struct iovec {
- *         void *iov_base;
- *         size_t iov_len;
- *     };
- */
-static size_t ring_peek(struct ring *r, struct iovec *vec)
-{
-	if (r->end > r->start) {
-		vec[0].iov_base = &r->buf[r->start];
-		vec[0].iov_len = r->end - r->start;
-		return 1;
-	} else if (r->end < r->start) {
-		vec[0].iov_base = &r->buf[r->start];
-		vec[0].iov_len = r->size - r->start;
-		vec[1].iov_base = r->buf;
-		vec[1].iov_len = r->end;
-		return 2;
-	} else {
-		return 0;
-	}
-}
-
 /*
  * Remove @len bytes from the start of the ring-buffer. Note that we protect
  * against overflows so removing more bytes than available is safe.
@@ -205,19 +336,10 @@ static void ring_pop(struct ring *r, size_t len)
 {
 	size_t l;
 
-	if (r->start > r->end) {
-		l = r->size - r->start;
-		if (l > len)
-			l = len;
-
-		r->start = RING_MASK(r, r->start + l);
-		len -= l;
-	}
-
-	if (!len)
+	if (r->end == r->start)
 		return;
 
-	l = r->end - r->start;
+	l = RING_MASK(r, r->end - r->start);
 	if (l > len)
 		l = len;
 
@@ -481,7 +603,7 @@ void shl_pty_unref(struct shl_pty *pty)
 		return;
 
 	shl_pty_close(pty);
-	free(pty->out_buf.buf);
+	ring_free(&pty->out_buf);
 	free(pty);
 }
 
@@ -509,54 +631,49 @@ pid_t shl_pty_get_child(struct shl_pty *pty)
 	return pty->child;
 }
 
-static void pty_write(struct shl_pty *pty)
+static int64_t pty_now_ns(void)
 {
-	struct iovec vec[2];
-	size_t num;
-	ssize_t r;
-
-	num = ring_peek(&pty->out_buf, vec);
-	if (!num)
-		return;
+	struct timespec ts;
 
-	/* ignore errors in favor of SIGCHLD; (we're edge-triggered, anyway) */
-	r = writev(pty->fd, vec, (int) num);
-	if (r >= 0)
-		ring_pop(&pty->out_buf, (size_t) r);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-static int pty_read(struct shl_pty *pty)
+static int pty_read(struct shl_pty *pty, size_t max_bytes, int64_t max_ns)
 {
-	ssize_t len, num;
+	int64_t deadline = max_ns ? pty_now_ns() + max_ns : 0;
+	size_t total = 0, chunk;
+	ssize_t len;
+
+	/* A writer that is faster than we are could stall us forever, so
+	 * reading stops once |max_bytes| were handed to the callback or
+	 * |max_ns| have passed (0 means no time limit). We return EAGAIN
+	 * then and let the caller decide when to come back. */
+	do {
+		chunk = max_bytes - total;
+		if (chunk > sizeof (pty->in_buf))
+			chunk = sizeof (pty->in_buf);
 
-	/* We're edge-triggered, means we need to read the whole queue. This,
-	 * however, might cause us to stall if the writer is faster than we
-	 * are. Therefore, we have some rather arbitrary limit on how fast
-	 * we read. If we reach it, we simply return EAGAIN to the caller and
-	 * let them deal with it. */
+		len = read(pty->fd, pty->in_buf, chunk);
+		if (len <= 0)
+			return 0;
 
-	/* Setting this as low as possible.  It will slow down long
-	 * file dumps, but, will respond to ctrl-c quicker, which is better
-	 * for our usage model
-	 */
-	num = 1;
-	do {
-		len = read(pty->fd, pty->in_buf, sizeof (pty->in_buf));
-		if (len > 0)
-			pty->cb(pty, pty->in_buf, len, pty->data);
-	}
-	while (len > 0 && --num);
+		pty->cb(pty, pty->in_buf, len, pty->data);
+		total += len;
+	} while (total < max_bytes && (!deadline || pty_now_ns() < deadline));
 
-	return !num ? -EAGAIN : 0;
+	return -EAGAIN;
 }
 
 int shl_pty_dispatch(struct shl_pty *pty)
 {
-	int r;
+	return shl_pty_dispatch_budget(pty, SHL_PTY_BUFSIZE, 0);
+}
 
-	r = pty_read(pty);
-	pty_write(pty);
-	return r;
+int shl_pty_dispatch_budget(struct shl_pty *pty, size_t max_bytes,
+			    int64_t max_ns)
+{
+	return pty_read(pty, max_bytes, max_ns);
 }
 
 int shl_pty_write(struct shl_pty *pty, const char *u8, size_t len)
@@ -567,6 +684,32 @@ int shl_pty_write(struct shl_pty *pty, const char *u8, size_t len)
 	return ring_push(&pty->out_buf, u8, len);
 }
 
+/*
+ * Write out as much of the queued output as the pty takes. Returns 1 if
+ * some of it is still queued, 0 once everything went out or a negative
+ * error code.
+ */
+int shl_pty_flush(struct shl_pty *pty)
+{
+	struct iovec vec[2];
+	size_t num;
+	ssize_t r;
+
+	if (!shl_pty_is_open(pty))
+		return -ENODEV;
+
+	num = ring_peek(&pty->out_buf, vec);
+	if (!num)
+		return 0;
+
+	r = writev(pty->fd, vec, (int) num);
+	if (r < 0)
+		return (errno == EAGAIN || errno == EINTR) ? 1 : -errno;
+
+	ring_pop(&pty->out_buf, (size_t) r);
+	return ring_peek(&pty->out_buf, vec) ? 1 : 0;
+}
+
 int shl_pty_signal(struct shl_pty *pty, int sig)
 {
 	int r;
@@ -644,6 +787,7 @@ int shl_pty_bridge_dispatch(int bridge, int timeout)
 		return 0;
 
 	pty = ev.data.ptr;
+	shl_pty_flush(pty);
 	r = shl_pty_dispatch(pty);
 	if (r == -EAGAIN) {
 		/* EAGAIN means we couldn't dispatch data fast enough. Modify
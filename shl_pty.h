@@ -38,7 +38,10 @@ int shl_pty_get_fd(struct shl_pty *pty);
 pid_t shl_pty_get_child(struct shl_pty *pty);
 
 int shl_pty_dispatch(struct shl_pty *pty);
+int shl_pty_dispatch_budget(struct shl_pty *pty, size_t max_bytes,
+			    int64_t max_ns);
 int shl_pty_write(struct shl_pty *pty, const char *u8, size_t len);
+int shl_pty_flush(struct shl_pty *pty);
 int shl_pty_signal(struct shl_pty *pty, int sig);
 int shl_pty_resize(struct shl_pty *pty, unsigned short term_width,
 		   unsigned short term_height);
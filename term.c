@@ -9,22 +9,35 @@
 #include <libtsm.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/select.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 #include "dbus.h"
+#include "event.h"
 #include "fb.h"
 #include "font.h"
 #include "image.h"
 #include "input.h"
 #include "main.h"
+#include "render.h"
 #include "shl_pty.h"
 #include "term.h"
 #include "util.h"
 
+#define TERM_SPAN_MAX 256
+
+/* One cell of the screen as drawn, a blank cell has ch 0. */
+typedef struct {
+	uint32_t ch;
+	uint32_t front_color;
+	uint32_t back_color;
+} term_cell_t;
+
 unsigned int term_num_terminals = 4;
 static terminal_t* terminals[TERM_MAX_TERMINALS];
 static uint32_t current_terminal = 0;
@@ -33,12 +46,45 @@ struct term {
 	struct tsm_screen* screen;
 	struct tsm_vte* vte;
 	struct shl_pty* pty;
-	int pty_bridge;
+	event_source_t* pty_source;
+	bool pty_hup;
+	/* Output queued by term_write_cb(), see term_flush_writes(). */
+	bool write_pending;
+	bool write_blocked;
+	size_t pty_budget;
 	int pid;
+	/* Becomes readable when the child exits, -1 if pidfds are unsupported. */
+	int pidfd;
+	event_source_t* pid_source;
+	bool child_done;
 	tsm_age_t age;
 	int char_x, char_y;
 	int pitch;
 	uint32_t* dst_image;
+	/*
+	 * Cells are not drawn one by one, consecutive cells on a row that
+	 * share colors are collected here and drawn by term_flush_span().
+	 */
+	struct {
+		unsigned int x, y;
+		int count;
+		bool blank;
+		uint32_t front_color, back_color;
+		uint32_t chars[TERM_SPAN_MAX];
+	} span;
+	/*
+	 * With pan scrolling or the render thread each frame is captured into
+	 * |cells| and compared with |prev_cells|, what the framebuffer holds,
+	 * to detect scrolling and find the cells that changed.
+	 */
+	term_cell_t* cells;
+	term_cell_t* prev_cells;
+	uint32_t* row_hash;
+	uint32_t* prev_row_hash;
+	bool prev_valid;
+	int shift;
+	/* The pan window moved, the pixels outside the grid are stale. */
+	bool fill_margin;
 };
 
 struct _terminal_t {
@@ -46,6 +92,9 @@ struct _terminal_t {
 	bool active;
 	uint32_t background;
 	bool background_valid;
+	bool background_light;
+	bool redraw_pending;
+	bool redraw_deferred;
 	fb_t* fb;
 	struct term* term;
 	char** exec;
@@ -63,6 +112,64 @@ static char* interactive_cmd_line[] = {
 static bool in_background = false;
 static bool hotplug_occured = false;
 
+/*
+ * Switching to a VT from the background is driven by the event loop so
+ * input and pty output keep flowing while Chrome releases the display:
+ * RELEASE waits (with the D-Bus call timeout) for Chrome's reply, MASTER
+ * retries drm_setmaster() with exponential backoff, then the terminal is
+ * modeset and drawn. The time spent in each phase is logged.
+ */
+#define VT_SWITCH_MASTER_RETRIES     5
+#define VT_SWITCH_MASTER_BACKOFF_MS  50
+
+typedef enum {
+	VT_SWITCH_IDLE,
+	VT_SWITCH_RELEASE,
+	VT_SWITCH_MASTER,
+} vt_switch_state_t;
+
+static struct {
+	vt_switch_state_t state;
+	unsigned int vt;
+	/* Tells replies to a cancelled switch apart from the current one. */
+	uintptr_t seq;
+	int retries;
+	int timer_fd;
+	event_source_t* timer_source;
+	int64_t start_ms, release_ms, master_ms;
+} vt_switch = {
+	.state = VT_SWITCH_IDLE,
+	.timer_fd = -1,
+};
+
+/*
+ * Redraws are coalesced and paced to the refresh rate of the display:
+ * redraw_timer_fd fires at most once per frame and renders every
+ * terminal that has redraw_pending set.
+ */
+static int redraw_timer_fd = -1;
+static event_source_t* redraw_timer_source = NULL;
+static bool redraw_timer_armed = false;
+static bool redraw_frame_due = false;
+static bool writes_pending = false;
+static int64_t last_redraw_ns = 0;
+
+/*
+ * Terminals that are not on screen only update their libtsm state and keep
+ * redraw_pending set, they are drawn when activated. Counts the renders
+ * saved that way.
+ */
+static uint64_t renders_skipped = 0;
+static uint64_t renders_skipped_logged = 0;
+
+/*
+ * With --shared-fb all terminals use one fb and only the terminal that
+ * was activated last draws into it, the others just keep their text.
+ */
+static fb_t* shared_fb = NULL;
+static int shared_fb_users = 0;
+static terminal_t* shared_fb_owner = NULL;
+
 
 static void __attribute__ ((noreturn)) term_run_child(terminal_t* terminal)
 {
@@ -77,32 +184,68 @@ static void __attribute__ ((noreturn)) term_run_child(terminal_t* terminal)
 	}
 }
 
-static int term_draw_cell(struct tsm_screen* screen, uint32_t id,
-			  const uint32_t* ch, size_t len,
-			  unsigned int cwidth, unsigned int posx,
-			  unsigned int posy,
-			  const struct tsm_screen_attr* attr,
-			  tsm_age_t age, void* data)
+static void term_flush_span(terminal_t* terminal)
 {
-	terminal_t* terminal = (terminal_t*)data;
-	uint32_t front_color, back_color;
-	uint8_t br, bb, bg;
-	uint32_t luminance;
+	struct term* term = terminal->term;
+	uint32_t char_width, char_height;
 
-	if (age && terminal->term->age && age <= terminal->term->age)
-		return 0;
+	if (term->span.count == 0)
+		return;
 
-	if (terminal->background_valid) {
-		br = (terminal->background >> 16) & 0xFF;
-		bg = (terminal->background >> 8) & 0xFF;
-		bb = (terminal->background) & 0xFF;
-		luminance = (3 * br + bb + 4 * bg) >> 3;
+	if (term->span.blank)
+		font_fill_span(term->dst_image, term->span.x, term->span.y,
+			       term->pitch, term->span.count,
+			       term->span.back_color);
+	else
+		font_render_span(term->dst_image, term->span.x, term->span.y,
+				 term->pitch, term->span.chars, term->span.count,
+				 term->span.front_color, term->span.back_color);
+
+	font_get_size(&char_width, &char_height);
+	fb_damage(terminal->fb, term->span.x * char_width,
+		  term->span.y * char_height,
+		  term->span.count * char_width, char_height);
+	term->span.count = 0;
+}
+
+static void term_span_add(terminal_t* terminal, unsigned int posx,
+			  unsigned int posy, uint32_t ch,
+			  uint32_t front_color, uint32_t back_color)
+{
+	struct term* term = terminal->term;
+	bool blank = ch == 0;
+
+	if (term->span.count == 0 ||
+	    term->span.count == TERM_SPAN_MAX ||
+	    term->span.y != posy ||
+	    term->span.x + term->span.count != posx ||
+	    term->span.blank != blank ||
+	    term->span.back_color != back_color ||
+	    (!blank && term->span.front_color != front_color)) {
+		term_flush_span(terminal);
+		term->span.x = posx;
+		term->span.y = posy;
+		term->span.blank = blank;
+		term->span.front_color = front_color;
+		term->span.back_color = back_color;
+	}
+
+	if (!blank)
+		term->span.chars[term->span.count] = ch;
+	term->span.count++;
+}
+
+static void term_get_cell(terminal_t* terminal, const uint32_t* ch, size_t len,
+			  const struct tsm_screen_attr* attr, term_cell_t* cell)
+{
+	uint32_t front_color, back_color;
 
+	if (terminal->background_valid) {
 		/*
 		 * FIXME: black is chosen on a dark background, but it uses the
 		 * default color for light backgrounds
 		 */
-		if (luminance > 128) {
+		if (terminal->background_light) {
 			front_color = 0;
 			back_color = terminal->background;
 		} else {
@@ -120,34 +263,397 @@ static int term_draw_cell(struct tsm_screen* screen, uint32_t id,
 		back_color = tmp;
 	}
 
-	if (len)
-		font_render(terminal->term->dst_image, posx, posy, terminal->term->pitch, *ch,
-					front_color, back_color);
-	else
-		font_fillchar(terminal->term->dst_image, posx, posy, terminal->term->pitch,
-						front_color, back_color);
+	/* A space renders like an empty cell, unless the font draws it. */
+	if (!len || (*ch == ' ' && font_space_is_blank())) {
+		cell->ch = 0;
+		cell->front_color = 0;
+	} else {
+		cell->ch = *ch;
+		cell->front_color = front_color;
+	}
+	cell->back_color = back_color;
+}
+
+static int term_draw_cell(struct tsm_screen* screen, uint32_t id,
+			  const uint32_t* ch, size_t len,
+			  unsigned int cwidth, unsigned int posx,
+			  unsigned int posy,
+			  const struct tsm_screen_attr* attr,
+			  tsm_age_t age, void* data)
+{
+	terminal_t* terminal = (terminal_t*)data;
+	term_cell_t cell;
+
+	if (age && terminal->term->age && age <= terminal->term->age)
+		return 0;
+
+	term_get_cell(terminal, ch, len, attr, &cell);
+	term_span_add(terminal, posx, posy, cell.ch, cell.front_color,
+		      cell.back_color);
 
 	return 0;
 }
 
-static void term_redraw(terminal_t* terminal)
+static int term_capture_cell(struct tsm_screen* screen, uint32_t id,
+			     const uint32_t* ch, size_t len,
+			     unsigned int cwidth, unsigned int posx,
+			     unsigned int posy,
+			     const struct tsm_screen_attr* attr,
+			     tsm_age_t age, void* data)
+{
+	terminal_t* terminal = (terminal_t*)data;
+	struct term* term = terminal->term;
+
+	if (posx < (unsigned int)term->char_x && posy < (unsigned int)term->char_y)
+		term_get_cell(terminal, ch, len, attr,
+			      &term->cells[posy * term->char_x + posx]);
+
+	return 0;
+}
+
+static uint32_t term_hash_row(const term_cell_t* row, int cols)
+{
+	uint32_t h = 2166136261u;
+
+	for (int c = 0; c < cols; c++) {
+		h = (h ^ row[c].ch) * 16777619u;
+		h = (h ^ row[c].front_color) * 16777619u;
+		h = (h ^ row[c].back_color) * 16777619u;
+	}
+	return h;
+}
+
+/*
+ * Returns by how many rows the screen contents moved up since the previous
+ * frame (negative when moved down), or 0 when most rows did not move
+ * together.
+ */
+static int term_find_scroll(struct term* term)
+{
+	int rows = term->char_y;
+	int best_shift = 0, best_matches = 0;
+
+	for (int r = 0; r < rows; r++)
+		best_matches += term->row_hash[r] == term->prev_row_hash[r];
+
+	for (int d = 1; d < rows; d++) {
+		for (int shift = d; shift >= -d; shift -= 2 * d) {
+			int matches = 0;
+			for (int r = MAX(0, -shift); r < MIN(rows, rows - shift); r++)
+				matches += term->row_hash[r] ==
+					   term->prev_row_hash[r + shift];
+			if (matches > best_matches) {
+				best_matches = matches;
+				best_shift = shift;
+			}
+		}
+	}
+
+	if (best_matches < rows / 2)
+		return 0;
+	return best_shift;
+}
+
+/*
+ * Grid redraw: the screen is captured into |cells| and only the cells that
+ * differ from what the buffer holds are drawn. A scroll moves the contents
+ * of the framebuffer first when it can. Capturing and presenting happen on
+ * the main thread, drawing the cells may run on the render thread, which
+ * owns the fb and the font until the frame is done.
+ */
+static bool term_grid_begin(terminal_t* terminal)
+{
+	struct term* term = terminal->term;
+	int cols = term->char_x, rows = term->char_y;
+	uint32_t char_width, char_height;
+	uint32_t* fb_buffer;
+
+	if (term->age == 0)
+		term->prev_valid = false;
+
+	term->age = tsm_screen_draw(term->screen, term_capture_cell, terminal);
+	for (int r = 0; r < rows; r++)
+		term->row_hash[r] = term_hash_row(&term->cells[r * cols], cols);
+
+	term->shift = 0;
+	term->fill_margin = false;
+	if (term->prev_valid && fb_can_scroll(terminal->fb)) {
+		term->shift = term_find_scroll(term);
+		font_get_size(&char_width, &char_height);
+		if (term->shift) {
+			/* Moved or wrapped, either way new pixels show. */
+			term->fill_margin = true;
+			if (!fb_scroll(terminal->fb,
+				       term->shift * (int32_t)char_height))
+				term->prev_valid = false;
+		}
+	}
+
+	fb_buffer = fb_lock(terminal->fb);
+	if (fb_buffer == NULL) {
+		term->prev_valid = false;
+		return false;
+	}
+
+	term->dst_image = fb_buffer;
+	return true;
+}
+
+/* Paint the pixels right of and below the character grid. */
+static void term_grid_fill_margin(terminal_t* terminal)
+{
+	struct term* term = terminal->term;
+	int32_t width = fb_getwidth(terminal->fb);
+	int32_t height = fb_getheight(terminal->fb);
+	uint32_t color = terminal->background_valid ? terminal->background : 0;
+	uint32_t char_width, char_height;
+	int32_t grid_width, grid_height;
+	uint32_t* dst = term->dst_image;
+
+	font_get_size(&char_width, &char_height);
+	grid_width = term->char_x * char_width;
+	grid_height = term->char_y * char_height;
+
+	for (int32_t y = 0; y < height; y++, dst += term->pitch / 4) {
+		int32_t x = y < grid_height ? grid_width : 0;
+
+		for (; x < width; x++)
+			dst[x] = color;
+	}
+
+	fb_damage(terminal->fb, grid_width, 0, width - grid_width, grid_height);
+	fb_damage(terminal->fb, 0, grid_height, width, height - grid_height);
+}
+
+static void term_grid_draw(void* data)
+{
+	terminal_t* terminal = (terminal_t*)data;
+	struct term* term = terminal->term;
+	int cols = term->char_x, rows = term->char_y;
+
+	if (term->fill_margin)
+		term_grid_fill_margin(terminal);
+
+	for (int r = 0; r < rows; r++) {
+		const term_cell_t* row = &term->cells[r * cols];
+		const term_cell_t* prev = NULL;
+		int prev_r = r + term->shift;
+
+		if (term->prev_valid && prev_r >= 0 && prev_r < rows) {
+			prev = &term->prev_cells[prev_r * cols];
+			if (term->row_hash[r] == term->prev_row_hash[prev_r] &&
+			    !memcmp(row, prev, cols * sizeof(*row)))
+				continue;
+		}
+
+		for (int c = 0; c < cols; c++) {
+			if (prev && !memcmp(&row[c], &prev[c], sizeof(*row)))
+				continue;
+			term_span_add(terminal, c, r, row[c].ch,
+				      row[c].front_color, row[c].back_color);
+		}
+	}
+	term_flush_span(terminal);
+}
+
+static void term_grid_end(void* data)
+{
+	terminal_t* terminal = (terminal_t*)data;
+	struct term* term = terminal->term;
+	void* tmp;
+
+	fb_unlock(terminal->fb);
+
+	tmp = term->prev_cells;
+	term->prev_cells = term->cells;
+	term->cells = tmp;
+	tmp = term->prev_row_hash;
+	term->prev_row_hash = term->row_hash;
+	term->row_hash = tmp;
+	term->prev_valid = true;
+}
+
+static void term_redraw_grid(terminal_t* terminal)
+{
+	if (!term_grid_begin(terminal))
+		return;
+
+	if (command_flags.render_thread &&
+	    render_submit(term_grid_draw, term_grid_end, terminal))
+		return;
+
+	term_grid_draw(terminal);
+	term_grid_end(terminal);
+}
+
+static bool term_owns_fb(terminal_t* terminal)
+{
+	return !command_flags.shared_fb || shared_fb_owner == terminal;
+}
+
+static fb_t* term_get_fb(unsigned vt)
+{
+	if (!command_flags.shared_fb)
+		return fb_init();
+
+	if (!shared_fb) {
+		shared_fb = fb_init();
+		if (!shared_fb)
+			return NULL;
+	}
+
+	shared_fb_users++;
+	if (shared_fb_users > 1)
+		LOG(INFO, "VT%u shares the scanout fb, %lld KiB of dumb buffers saved.",
+		    vt, (long long)(shared_fb_users - 1) * fb_getsize(shared_fb) / 1024);
+
+	return shared_fb;
+}
+
+static void term_put_fb(terminal_t* terminal)
+{
+	if (!command_flags.shared_fb) {
+		fb_close(terminal->fb);
+		return;
+	}
+
+	if (shared_fb_owner == terminal)
+		shared_fb_owner = NULL;
+	if (--shared_fb_users == 0) {
+		fb_close(shared_fb);
+		shared_fb = NULL;
+	}
+}
+
+static bool term_is_visible(terminal_t* terminal)
+{
+	return !in_background && terminal->active && term_owns_fb(terminal);
+}
+
+static void term_render(terminal_t* terminal)
 {
 	uint32_t* fb_buffer;
+
+	render_wait();
+	terminal->redraw_pending = false;
+	terminal->redraw_deferred = false;
+
+	if (terminal->term->cells) {
+		term_redraw_grid(terminal);
+		return;
+	}
+
 	fb_buffer = fb_lock(terminal->fb);
 	if (fb_buffer != NULL) {
 		terminal->term->dst_image = fb_buffer;
 		terminal->term->age =
 			tsm_screen_draw(terminal->term->screen, term_draw_cell, terminal);
+		term_flush_span(terminal);
 		fb_unlock(terminal->fb);
 	}
 }
 
+static void term_redraw(terminal_t* terminal)
+{
+	if (term_is_visible(terminal)) {
+		term_render(terminal);
+		return;
+	}
+
+	if (!terminal->redraw_pending)
+		renders_skipped++;
+	terminal->redraw_pending = true;
+	terminal->redraw_deferred = false;
+}
+
+static int64_t term_frame_interval_ns(void)
+{
+	terminal_t* terminal = term_get_current_terminal();
+	int32_t refresh = 60;
+
+	if (term_is_valid(terminal) && terminal->fb)
+		refresh = fb_getrefresh(terminal->fb);
+
+	return NS_PER_SEC / refresh;
+}
+
+static void term_redraw_timer_event(uint32_t events, void* data)
+{
+	struct timespec now;
+	uint64_t expirations;
+
+	if (read(redraw_timer_fd, &expirations, sizeof(expirations)) < 0 &&
+	    errno == EAGAIN)
+		return;
+
+	/* Rendering is left to term_dispatch_redraw() after all pty input. */
+	redraw_frame_due = true;
+	redraw_timer_armed = false;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	last_redraw_ns = now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+/*
+ * Mark |terminal| for redrawing. The actual rendering happens from
+ * term_dispatch_redraw() once the current frame interval has elapsed, so
+ * all pty data that arrives in the meantime is drawn in a single pass.
+ */
+static void term_schedule_redraw(terminal_t* terminal)
+{
+	struct itimerspec timer;
+	struct timespec now;
+	int64_t next_ns;
+
+	if (!term_is_visible(terminal)) {
+		term_redraw(terminal);
+		return;
+	}
+
+	terminal->redraw_pending = true;
+
+	if (redraw_timer_armed)
+		return;
+
+	if (redraw_timer_fd < 0) {
+		redraw_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+						 TFD_NONBLOCK | TFD_CLOEXEC);
+		if (redraw_timer_fd < 0) {
+			LOG(ERROR, "Failed to create redraw timer: %m");
+			term_redraw(terminal);
+			return;
+		}
+		redraw_timer_source = event_add(redraw_timer_fd, EPOLLIN,
+						term_redraw_timer_event, NULL);
+		if (!redraw_timer_source) {
+			close(redraw_timer_fd);
+			redraw_timer_fd = -1;
+			term_redraw(terminal);
+			return;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	next_ns = last_redraw_ns + term_frame_interval_ns();
+	if (next_ns <= now.tv_sec * NS_PER_SEC + now.tv_nsec)
+		next_ns = now.tv_sec * NS_PER_SEC + now.tv_nsec + 1;
+
+	memset(&timer, 0, sizeof(timer));
+	timer.it_value.tv_sec = next_ns / NS_PER_SEC;
+	timer.it_value.tv_nsec = next_ns % NS_PER_SEC;
+	if (timerfd_settime(redraw_timer_fd, TFD_TIMER_ABSTIME, &timer, NULL) < 0) {
+		LOG(ERROR, "Failed to arm redraw timer: %m");
+		term_redraw(terminal);
+		return;
+	}
+	redraw_timer_armed = true;
+}
+
 void term_key_event(terminal_t* terminal, uint32_t keysym, int32_t unicode)
 {
 	if (tsm_vte_handle_keyboard(terminal->term->vte, keysym, 0, 0, unicode))
 		tsm_screen_sb_reset(terminal->term->screen);
 
-	term_redraw(terminal);
+	term_schedule_redraw(terminal);
 }
 
 static void term_read_cb(struct shl_pty* pty, char* u8, size_t len, void* data)
@@ -156,7 +662,7 @@ static void term_read_cb(struct shl_pty* pty, char* u8, size_t len, void* data)
 
 	tsm_vte_input(terminal->term->vte, u8, len);
 
-	term_redraw(terminal);
+	term_schedule_redraw(terminal);
 }
 
 static void term_write_cb(struct tsm_vte* vte, const char* u8, size_t len,
@@ -169,7 +675,112 @@ static void term_write_cb(struct tsm_vte* vte, const char* u8, size_t len,
 	if (r < 0)
 		LOG(ERROR, "OOM in pty-write (%d)", r);
 
-	shl_pty_dispatch(term->pty);
+	/* Written by term_flush_writes() once the loop iteration is done. */
+	term->write_pending = true;
+	writes_pending = true;
+}
+
+static void term_update_pty_events(struct term* term)
+{
+	uint32_t events = EPOLLIN;
+
+	if (term->pty_hup)
+		events |= EPOLLET;
+	if (term->write_blocked)
+		events |= EPOLLOUT;
+	event_modify(term->pty_source, events);
+}
+
+static void term_flush_pty(struct term* term)
+{
+	bool blocked;
+
+	term->write_pending = false;
+	/* On errors the output stays queued until the next write. */
+	blocked = shl_pty_flush(term->pty) > 0;
+	if (blocked != term->write_blocked) {
+		/* Wait for the pty to take more instead of retrying. */
+		term->write_blocked = blocked;
+		term_update_pty_events(term);
+	}
+}
+
+/*
+ * Bytes of pty output parsed per wakeup. The budget grows while a pty
+ * floods us (dmesg, cat) so big dumps are not slowed down by the event
+ * loop, and drops to the minimum as soon as keys are pending so Ctrl-C is
+ * seen quickly. Each dispatch is also limited to TERM_PTY_TIME_BUDGET_NS.
+ */
+#define TERM_PTY_BUDGET_MIN      (4 * 1024)
+#define TERM_PTY_BUDGET_DEFAULT  (16 * 1024)
+#define TERM_PTY_BUDGET_MAX      (1024 * 1024)
+#define TERM_PTY_TIME_BUDGET_NS  (2 * 1000 * 1000)
+
+static void term_pty_event(uint32_t events, void* data)
+{
+	terminal_t* terminal = (terminal_t*)data;
+	struct term* term = terminal->term;
+	int r;
+
+	/*
+	 * The master reports a hangup for as long as no slave is open, which
+	 * also happens briefly while getty reopens the tty. Only wake up on
+	 * new data then instead of spinning on the hangup.
+	 */
+	if (events & (EPOLLHUP | EPOLLERR)) {
+		if (!term->pty_hup) {
+			term->pty_hup = true;
+			term->write_blocked = false;
+			term_update_pty_events(term);
+		}
+		while (shl_pty_dispatch(term->pty) == -EAGAIN)
+			;
+		return;
+	}
+
+	if (term->pty_hup) {
+		term->pty_hup = false;
+		term_update_pty_events(term);
+	}
+
+	if (events & EPOLLOUT)
+		term_flush_pty(term);
+	if (!(events & EPOLLIN))
+		return;
+
+	/* Only a flood reads past one chunk, no need to poll input otherwise. */
+	if (term->pty_budget > TERM_PTY_BUDGET_DEFAULT && input_pending())
+		term->pty_budget = TERM_PTY_BUDGET_MIN;
+
+	r = shl_pty_dispatch_budget(term->pty, term->pty_budget,
+				    TERM_PTY_TIME_BUDGET_NS);
+	if (r == -EAGAIN)
+		term->pty_budget = MIN(term->pty_budget * 2, TERM_PTY_BUDGET_MAX);
+	else
+		term->pty_budget = MAX(term->pty_budget / 2, TERM_PTY_BUDGET_DEFAULT);
+}
+
+static void term_child_event(uint32_t events, void* data)
+{
+	struct term* term = (struct term*)data;
+
+	waitpid(term->pid, NULL, WNOHANG);
+	term->child_done = true;
+
+	event_remove(term->pid_source);
+	term->pid_source = NULL;
+	close(term->pidfd);
+	term->pidfd = -1;
+}
+
+static int term_pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
 }
 
 static void term_esc_show_image(terminal_t* terminal, char* params)
@@ -273,6 +884,9 @@ static void term_esc_draw_box(terminal_t* terminal, char* params)
 	offx *= scale;
 	offy *= scale;
 
+	if (!term_owns_fb(terminal))
+		goto done;
+
 	buffer = fb_lock(terminal->fb);
 	if (buffer == NULL)
 		goto done;
@@ -318,6 +932,7 @@ static void term_esc_draw_box(terminal_t* terminal, char* params)
 		for (uint32_t x = 0; x < w; x++)
 			o[x] = color;
 	}
+	fb_damage(terminal->fb, startx, starty, w, h);
 done_fb:
 	fb_unlock(terminal->fb);
 done:
@@ -331,6 +946,12 @@ static void term_osc_cb(struct tsm_vte *vte, const uint32_t *osc_string,
 	size_t i;
 	char *osc;
 
+	/* The framebuffer is left alone while Chrome owns the display. */
+	if (in_background)
+		return;
+
+	render_wait();
+
 	for (i = 0; i < osc_len; i++)
 		if (osc_string[i] >= 128)
 			return; /* we only want to deal with ASCII */
@@ -345,6 +966,13 @@ static void term_osc_cb(struct tsm_vte *vte, const uint32_t *osc_string,
 		osc[i] = (char)osc_string[i];
 	osc[i] = '\0';
 
+	/*
+	 * Graphics go on top of the text that came before them, so that text
+	 * is drawn even if the terminal is hidden.
+	 */
+	if (terminal->redraw_pending && term_owns_fb(terminal))
+		term_render(terminal);
+
 	if (strncmp(osc, "image:", 6) == 0)
 		term_esc_show_image(terminal, osc + 6);
 	else if (strncmp(osc, "box:", 4) == 0)
@@ -386,11 +1014,41 @@ static void log_tsm(void* data, const char* file, int line, const char* fn,
 	fprintf(stderr, "\n");
 }
 
+static void term_free_grid(struct term* term)
+{
+	free(term->cells);
+	free(term->prev_cells);
+	free(term->row_hash);
+	free(term->prev_row_hash);
+	term->cells = NULL;
+	term->prev_cells = NULL;
+	term->row_hash = NULL;
+	term->prev_row_hash = NULL;
+	term->prev_valid = false;
+}
+
+static void term_alloc_grid(struct term* term)
+{
+	size_t cells = term->char_x * term->char_y;
+
+	term_free_grid(term);
+	term->cells = calloc(cells, sizeof(*term->cells));
+	term->prev_cells = calloc(cells, sizeof(*term->prev_cells));
+	term->row_hash = calloc(term->char_y, sizeof(*term->row_hash));
+	term->prev_row_hash = calloc(term->char_y, sizeof(*term->prev_row_hash));
+	if (!term->cells || !term->prev_cells ||
+	    !term->row_hash || !term->prev_row_hash) {
+		LOG(WARNING, "Out of memory for the screen grid, drawing without it.");
+		term_free_grid(term);
+	}
+}
+
 static int term_resize(terminal_t* term)
 {
 	uint32_t char_width, char_height;
 	int status;
 
+	render_wait();
 	font_init(fb_getscaling(term->fb));
 	font_get_size(&char_width, &char_height);
 
@@ -412,6 +1070,11 @@ static int term_resize(terminal_t* term)
 		return -1;
 	}
 
+	if (fb_can_scroll(term->fb) || command_flags.render_thread)
+		term_alloc_grid(term->term);
+	else
+		term_free_grid(term->term);
+
 	return 0;
 }
 
@@ -450,7 +1113,7 @@ terminal_t* term_init(unsigned vt, int pts_fd)
 	new_terminal->vt = vt;
 	new_terminal->background_valid = false;
 
-	new_terminal->fb = fb_init();
+	new_terminal->fb = term_get_fb(vt);
 
 	if (!new_terminal->fb) {
 		LOG(ERROR, "Failed to create fb on VT%u.", vt);
@@ -463,6 +1126,8 @@ terminal_t* term_init(unsigned vt, int pts_fd)
 		term_close(new_terminal);
 		return NULL;
 	}
+	new_terminal->term->pidfd = -1;
+	new_terminal->term->pty_budget = TERM_PTY_BUDGET_DEFAULT;
 
 	if (interactive)
 		new_terminal->exec = interactive_cmd_line;
@@ -491,13 +1156,6 @@ terminal_t* term_init(unsigned vt, int pts_fd)
 	if (command_flags.enable_gfx)
 		tsm_vte_set_osc_cb(new_terminal->term->vte, term_osc_cb, (void *)new_terminal);
 
-	new_terminal->term->pty_bridge = shl_pty_bridge_new();
-	if (new_terminal->term->pty_bridge < 0) {
-		LOG(ERROR, "Failed to create pty bridge on VT%u.", vt);
-		term_close(new_terminal);
-		return NULL;
-	}
-
 	status = shl_pty_open(&new_terminal->term->pty,
 			term_read_cb, new_terminal, 1, 1, pts_fd);
 
@@ -522,15 +1180,29 @@ terminal_t* term_init(unsigned vt, int pts_fd)
 			    errno, strerror(errno));
 	}
 
-	status = shl_pty_bridge_add(new_terminal->term->pty_bridge, new_terminal->term->pty);
-	if (status) {
-		LOG(ERROR, "Failed to add pty bridge on VT%u.", vt);
+	new_terminal->term->pty_source =
+		event_add(shl_pty_get_fd(new_terminal->term->pty), EPOLLIN,
+			  term_pty_event, new_terminal);
+	if (!new_terminal->term->pty_source) {
+		LOG(ERROR, "Failed to watch pty on VT%u.", vt);
 		term_close(new_terminal);
 		return NULL;
 	}
 
 	new_terminal->term->pid = shl_pty_get_child(new_terminal->term->pty);
 
+	/* Without pidfd support term_is_child_done() falls back to polling. */
+	new_terminal->term->pidfd = term_pidfd_open(new_terminal->term->pid);
+	if (new_terminal->term->pidfd >= 0) {
+		new_terminal->term->pid_source =
+			event_add(new_terminal->term->pidfd, EPOLLIN,
+				  term_child_event, new_terminal->term);
+		if (!new_terminal->term->pid_source) {
+			close(new_terminal->term->pidfd);
+			new_terminal->term->pidfd = -1;
+		}
+	}
+
 	status = term_resize(new_terminal);
 
 	if (status < 0) {
@@ -544,8 +1216,25 @@ terminal_t* term_init(unsigned vt, int pts_fd)
 
 void term_activate(terminal_t* terminal)
 {
+	render_wait();
 	term_set_current_to(terminal);
 	terminal->active = true;
+
+	/* Drawn by the VT switch once the display is ours again. */
+	if (in_background)
+		return;
+
+	if (renders_skipped != renders_skipped_logged) {
+		LOG(INFO, "Skipped %llu renders of hidden terminals.",
+		    (unsigned long long)renders_skipped);
+		renders_skipped_logged = renders_skipped;
+	}
+
+	if (command_flags.shared_fb && shared_fb_owner != terminal) {
+		/* The fb holds another terminal's screen, repaint all of it. */
+		shared_fb_owner = terminal;
+		terminal->term->age = 0;
+	}
 	fb_setmode(terminal->fb);
 	term_redraw(terminal);
 }
@@ -567,21 +1256,30 @@ void term_close(terminal_t* term)
 	snprintf(path, sizeof(path), FRECON_VT_PATH, term->vt);
 	unlink(path);
 
+	render_wait();
 	if (term->fb) {
-		fb_close(term->fb);
+		term_put_fb(term);
 		term->fb = NULL;
 	}
 
 	if (term->term) {
+		if (term->term->pid_source) {
+			event_remove(term->term->pid_source);
+			term->term->pid_source = NULL;
+		}
+		if (term->term->pidfd >= 0) {
+			close(term->term->pidfd);
+			term->term->pidfd = -1;
+		}
 		if (term->term->pty) {
-			if (term->term->pty_bridge >= 0) {
-				shl_pty_bridge_remove(term->term->pty_bridge, term->term->pty);
-				shl_pty_bridge_free(term->term->pty_bridge);
-				term->term->pty_bridge = -1;
+			if (term->term->pty_source) {
+				event_remove(term->term->pty_source);
+				term->term->pty_source = NULL;
 			}
 			shl_pty_close(term->term->pty);
 			term->term->pty = NULL;
 		}
+		term_free_grid(term->term);
 		free(term->term);
 		term->term = NULL;
 	}
@@ -594,6 +1292,10 @@ bool term_is_child_done(terminal_t* terminal)
 {
 	int status;
 	int ret;
+
+	if (terminal->term->child_done || terminal->term->pid_source)
+		return terminal->term->child_done;
+
 	ret = waitpid(terminal->term->pid, &status, WNOHANG);
 
 	if ((ret == -1) && (errno == ECHILD)) {
@@ -605,25 +1307,25 @@ bool term_is_child_done(terminal_t* terminal)
 void term_page_up(terminal_t* terminal)
 {
 	tsm_screen_sb_page_up(terminal->term->screen, 1);
-	term_redraw(terminal);
+	term_schedule_redraw(terminal);
 }
 
 void term_page_down(terminal_t* terminal)
 {
 	tsm_screen_sb_page_down(terminal->term->screen, 1);
-	term_redraw(terminal);
+	term_schedule_redraw(terminal);
 }
 
 void term_line_up(terminal_t* terminal)
 {
 	tsm_screen_sb_up(terminal->term->screen, 1);
-	term_redraw(terminal);
+	term_schedule_redraw(terminal);
 }
 
 void term_line_down(terminal_t* terminal)
 {
 	tsm_screen_sb_down(terminal->term->screen, 1);
-	term_redraw(terminal);
+	term_schedule_redraw(terminal);
 }
 
 bool term_is_valid(terminal_t* terminal)
@@ -633,29 +1335,58 @@ bool term_is_valid(terminal_t* terminal)
 
 int term_fd(terminal_t* terminal)
 {
-	if (term_is_valid(terminal))
-		return terminal->term->pty_bridge;
+	if (term_is_valid(terminal) && terminal->term->pty)
+		return shl_pty_get_fd(terminal->term->pty);
 	else
 		return -1;
 }
 
-void term_dispatch_io(terminal_t* terminal, fd_set* read_set)
+/*
+ * Write out what term_write_cb() queued during this loop iteration, one
+ * writev() per pty. A pty that cannot take everything is watched for
+ * EPOLLOUT and flushed from term_pty_event().
+ */
+void term_flush_writes(void)
 {
-	if (term_is_valid(terminal))
-		if (FD_ISSET(terminal->term->pty_bridge, read_set))
-			shl_pty_bridge_dispatch(terminal->term->pty_bridge, 0);
+	if (!writes_pending)
+		return;
+	writes_pending = false;
+
+	for (unsigned i = 0; i < TERM_MAX_TERMINALS; i++) {
+		terminal_t* terminal = terminals[i];
+
+		if (term_is_valid(terminal) && terminal->term->pty &&
+		    terminal->term->write_pending)
+			term_flush_pty(terminal->term);
+	}
 }
 
-bool term_exception(terminal_t* terminal, fd_set* exception_set)
+void term_dispatch_redraw(void)
 {
-	if (term_is_valid(terminal)) {
-		if (terminal->term->pty_bridge >= 0) {
-			return FD_ISSET(terminal->term->pty_bridge,
-					exception_set);
+	bool frame = redraw_frame_due;
+
+	redraw_frame_due = false;
+
+	for (unsigned i = 0; i < TERM_MAX_TERMINALS; i++) {
+		terminal_t* terminal = terminals[i];
+
+		if (!term_is_valid(terminal) || !terminal->redraw_pending)
+			continue;
+		if (!term_is_visible(terminal))
+			continue;
+		if (!frame && !terminal->redraw_deferred)
+			continue;
+
+		/*
+		 * Never wait for a page flip or the render thread here, the
+		 * frame is drawn as soon as they are done instead.
+		 */
+		if (fb_flip_pending(terminal->fb) || render_busy()) {
+			terminal->redraw_deferred = true;
+			continue;
 		}
+		term_redraw(terminal);
 	}
-
-	return false;
 }
 
 bool term_is_active(terminal_t* terminal)
@@ -666,17 +1397,6 @@ bool term_is_active(terminal_t* terminal)
 	return false;
 }
 
-void term_add_fds(terminal_t* terminal, fd_set* read_set, fd_set* exception_set, int* maxfd)
-{
-	if (term_is_valid(terminal)) {
-		if (terminal->term->pty_bridge >= 0) {
-			*maxfd = MAX(*maxfd, terminal->term->pty_bridge);
-			FD_SET(terminal->term->pty_bridge, read_set);
-			FD_SET(terminal->term->pty_bridge, exception_set);
-		}
-	}
-}
-
 const char* term_get_ptsname(terminal_t* terminal)
 {
 	return ptsname(shl_pty_get_fd(terminal->term->pty));
@@ -684,12 +1404,20 @@ const char* term_get_ptsname(terminal_t* terminal)
 
 void term_set_background(terminal_t* terminal, uint32_t bg)
 {
+	uint8_t r = (bg >> 16) & 0xFF;
+	uint8_t g = (bg >> 8) & 0xFF;
+	uint8_t b = bg & 0xFF;
+
 	terminal->background = bg;
 	terminal->background_valid = true;
+	terminal->background_light = ((3 * r + b + 4 * g) >> 3) > 128;
 }
 
 int term_show_image(terminal_t* terminal, image_t* image)
 {
+	if (!term_owns_fb(terminal))
+		return 0;
+	render_wait();
 	return image_show(image, terminal->fb);
 }
 
@@ -799,6 +1527,134 @@ void term_set_current_to(terminal_t* terminal)
 	LOG(ERROR, "set_current_to: terminal not in array");
 }
 
+static int term_switch_activate(unsigned int vt)
+{
+	terminal_t* terminal;
+
+	term_set_current(vt);
+	terminal = term_get_current_terminal();
+	if (!terminal) {
+		/* No terminal where we are switching to, create new one. */
+		term_set_current_terminal(term_init(vt, -1));
+		terminal = term_get_current_terminal();
+		if (!term_is_valid(terminal)) {
+			LOG(ERROR, "Term init failed VT%u.", vt);
+			return -1;
+		}
+		term_activate(terminal);
+	} else {
+		term_activate(terminal);
+	}
+
+	return vt;
+}
+
+static void term_switch_set_timer(int64_t ms)
+{
+	struct itimerspec timer;
+
+	memset(&timer, 0, sizeof(timer));
+	timer.it_value.tv_sec = ms / MS_PER_SEC;
+	timer.it_value.tv_nsec = (ms % MS_PER_SEC) * NS_PER_MS;
+	timerfd_settime(vt_switch.timer_fd, 0, &timer, NULL);
+}
+
+static void term_switch_try_master(void)
+{
+	int64_t now;
+	int ret;
+
+	ret = drm_setmaster(NULL);
+	if (ret < 0 && vt_switch.retries < VT_SWITCH_MASTER_RETRIES &&
+	    vt_switch.timer_source) {
+		/*
+		 * In case there is high system load give Chrome some time
+		 * and try again.
+		 */
+		term_switch_set_timer(VT_SWITCH_MASTER_BACKOFF_MS << vt_switch.retries);
+		vt_switch.retries++;
+		return;
+	}
+	if (ret < 0)
+		LOG(ERROR, "Could not set master when switching to foreground %m.");
+
+	vt_switch.master_ms = get_monotonic_time_ms();
+	vt_switch.state = VT_SWITCH_IDLE;
+	in_background = false;
+
+	if (hotplug_occured) {
+		hotplug_occured = false;
+		term_monitor_hotplug();
+	}
+
+	term_switch_activate(vt_switch.vt);
+
+	now = get_monotonic_time_ms();
+	LOG(INFO, "Switched to VT%u in %lld ms (release %lld ms, master %lld ms"
+	    " after %d retries, modeset and draw %lld ms).", vt_switch.vt,
+	    (long long)(now - vt_switch.start_ms),
+	    (long long)(vt_switch.release_ms - vt_switch.start_ms),
+	    (long long)(vt_switch.master_ms - vt_switch.release_ms),
+	    vt_switch.retries,
+	    (long long)(now - vt_switch.master_ms));
+}
+
+static void term_switch_timer_event(uint32_t events, void* data)
+{
+	uint64_t expirations;
+
+	if (read(vt_switch.timer_fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	if (vt_switch.state == VT_SWITCH_MASTER)
+		term_switch_try_master();
+}
+
+static void term_switch_released(bool released, void* userptr)
+{
+	if ((uintptr_t)userptr != vt_switch.seq ||
+	    vt_switch.state != VT_SWITCH_RELEASE)
+		return;
+
+	if (!released) {
+		LOG(ERROR, "Chrome did not release master. Frecon will try to steal it.");
+		set_drm_master_relax();
+	}
+
+	vt_switch.release_ms = get_monotonic_time_ms();
+	vt_switch.state = VT_SWITCH_MASTER;
+	vt_switch.retries = 0;
+	term_switch_try_master();
+}
+
+/*
+ * Start taking the display back from Chrome to show |vt|, or retarget a
+ * switch that is already in progress.
+ */
+static void term_foreground(unsigned int vt)
+{
+	vt_switch.vt = vt;
+	if (vt_switch.state != VT_SWITCH_IDLE)
+		return;
+
+	if (vt_switch.timer_fd < 0) {
+		vt_switch.timer_fd = timerfd_create(CLOCK_MONOTONIC,
+						    TFD_NONBLOCK | TFD_CLOEXEC);
+		if (vt_switch.timer_fd < 0)
+			LOG(ERROR, "Failed to create VT switch timer: %m");
+		else
+			vt_switch.timer_source = event_add(vt_switch.timer_fd,
+					EPOLLIN, term_switch_timer_event, NULL);
+	}
+
+	vt_switch.state = VT_SWITCH_RELEASE;
+	vt_switch.seq++;
+	vt_switch.start_ms = get_monotonic_time_ms();
+	if (!dbus_release_display_ownership(term_switch_released,
+					    (void*)vt_switch.seq))
+		term_switch_released(false, (void*)vt_switch.seq);
+}
+
 int term_switch_to(unsigned int vt)
 {
 	terminal_t *terminal;
@@ -827,24 +1683,13 @@ int term_switch_to(unsigned int vt)
 		return vt;
 	}
 
-	term_foreground();
-
-	term_set_current(vt);
-	terminal = term_get_current_terminal();
-	if (!terminal) {
-		/* No terminal where we are switching to, create new one. */
-		term_set_current_terminal(term_init(vt, -1));
-		terminal = term_get_current_terminal();
-		if (!term_is_valid(terminal)) {
-			LOG(ERROR, "Term init failed VT%u.", vt);
-			return -1;
-		}
-		term_activate(terminal);
-	} else {
-		term_activate(terminal);
+	if (in_background) {
+		/* Activated by the VT switch state machine. */
+		term_foreground(vt);
+		return vt;
 	}
 
-	return vt;
+	return term_switch_activate(vt);
 }
 
 void term_monitor_hotplug(void)
@@ -856,6 +1701,7 @@ void term_monitor_hotplug(void)
 		return;
 	}
 
+	render_wait();
 	if (!drm_rescan())
 		return;
 
@@ -873,6 +1719,8 @@ void term_monitor_hotplug(void)
 			continue;
 		if (!terminals[t]->fb)
 			continue;
+		/* The previous terminal's frame may use a shared fb. */
+		render_wait();
 		fb_buffer_init(terminals[t]->fb);
 		term_resize(terminals[t]);
 		if (current_terminal == t && terminals[t]->active)
@@ -884,12 +1732,25 @@ void term_monitor_hotplug(void)
 
 void term_redrm(terminal_t* terminal)
 {
+	render_wait();
 	fb_buffer_destroy(terminal->fb);
 	font_free();
 	fb_buffer_init(terminal->fb);
 	term_resize(terminal);
 	terminal->term->age = 0;
 	term_redraw(terminal);
+
+	/* Other users of a shared fb have to follow the new size. */
+	if (terminal->fb != shared_fb)
+		return;
+	for (unsigned t = 0; t < term_num_terminals; t++) {
+		if (!terminals[t] || terminals[t] == terminal ||
+		    terminals[t]->fb != shared_fb)
+			continue;
+		font_free();
+		term_resize(terminals[t]);
+		terminals[t]->term->age = 0;
+	}
 }
 
 void term_clear(terminal_t* terminal)
@@ -900,41 +1761,22 @@ void term_clear(terminal_t* terminal)
 
 void term_background(void)
 {
+	if (vt_switch.state != VT_SWITCH_IDLE) {
+		/* Chrome may already have let go, hand the display back. */
+		vt_switch.state = VT_SWITCH_IDLE;
+		if (vt_switch.timer_fd >= 0)
+			term_switch_set_timer(0);
+		in_background = false;
+	}
+
 	if (in_background)
 		return;
+	render_wait();
 	in_background = true;
 	drm_dropmaster(NULL);
 	dbus_take_display_ownership();
 }
 
-void term_foreground(void)
-{
-	int ret;
-	if (!in_background)
-		return;
-	in_background = false;
-	if (!dbus_release_display_ownership()) {
-		LOG(ERROR, "Chrome did not release master. Frecon will try to steal it.");
-		set_drm_master_relax();
-	}
-
-	ret = drm_setmaster(NULL);
-	if (ret < 0) {
-		/*
-		 * In case there is high system load give Chrome some time
-		 * and try again. */
-		usleep(500 * 1000);
-		ret = drm_setmaster(NULL);
-	}
-	if (ret < 0)
-		LOG(ERROR, "Could not set master when switching to foreground %m.");
-
-	if (hotplug_occured) {
-		hotplug_occured = false;
-		term_monitor_hotplug();
-	}
-}
-
 void term_suspend_done(void* ignore)
 {
 	term_monitor_hotplug();
@@ -34,12 +34,11 @@ void term_line_down(terminal_t* terminal);
 
 bool term_is_valid(terminal_t* terminal);
 int term_fd(terminal_t* terminal);
-void term_dispatch_io(terminal_t* terminal, fd_set* read_set);
-bool term_exception(terminal_t*, fd_set* exception_set);
+void term_flush_writes(void);
+void term_dispatch_redraw(void);
 bool term_is_active(terminal_t*);
 void term_activate(terminal_t*);
 void term_deactivate(terminal_t* terminal);
-void term_add_fds(terminal_t* terminal, fd_set* read_set, fd_set* exception_set, int* maxfd);
 const char* term_get_ptsname(terminal_t* terminal);
 void term_set_background(terminal_t* term, uint32_t bg);
 int term_show_image(terminal_t* terminal, image_t* image);
@@ -59,6 +58,5 @@ void term_monitor_hotplug(void);
 void term_redrm(terminal_t* terminal);
 void term_clear(terminal_t* terminal);
 void term_background(void);
-void term_foreground(void);
 void term_suspend_done(void*);
 #endif
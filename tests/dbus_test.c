@@ -0,0 +1,340 @@
+/*
+ * Copyright 2016 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Runs dbus.c against a private dbus-daemon, with a stub powerd in a child
+ * process. Checks that user activity is reported without waiting for
+ * powerd, coalesced and sent without asking for a reply, and that the
+ * replies to the brightness calls, an error and a timeout, are picked up
+ * by the event loop. ReleaseDisplayOwnership replies have to reach the
+ * callback, and the call data handed to the pending call has to be freed
+ * by it.
+ */
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+
+/* Count the allocations dbus.c still holds. */
+static int allocations;
+
+static void* test_calloc(size_t nmemb, size_t size)
+{
+	void* ptr = calloc(nmemb, size);
+
+	if (ptr)
+		allocations++;
+	return ptr;
+}
+
+static void test_free(void* ptr)
+{
+	if (ptr)
+		allocations--;
+	free(ptr);
+}
+
+#define calloc test_calloc
+#define free test_free
+#include "../dbus.c"
+#undef calloc
+#undef free
+
+#define TEST_ERROR "org.chromium.Test.Failed"
+#define TEST_GET_COUNTS "GetCounts"
+#define TEST_REPLY_WAIT_MS (DBUS_DEFAULT_DELAY + 2000)
+
+static int failures;
+static int releases_ok, releases_failed;
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * MS_PER_SEC + ts.tv_nsec / 1000000;
+}
+
+static void check(bool ok, const char* what)
+{
+	printf("%-60s %s\n", what, ok ? "ok" : "FAILED");
+	if (!ok)
+		failures++;
+}
+
+/* Starts a session dbus-daemon and returns its pid, or -1. */
+static pid_t start_bus(char* address, size_t size)
+{
+	int fds[2];
+	char fd_arg[32];
+	ssize_t len;
+	pid_t pid;
+
+	if (pipe(fds) < 0)
+		return -1;
+
+	pid = fork();
+	if (pid == 0) {
+		close(fds[0]);
+		snprintf(fd_arg, sizeof(fd_arg), "--print-address=%d", fds[1]);
+		execlp("dbus-daemon", "dbus-daemon", "--session", "--nofork",
+		       fd_arg, NULL);
+		_exit(127);
+	}
+	close(fds[1]);
+
+	len = read(fds[0], address, size - 1);
+	close(fds[0]);
+	if (len <= 0) {
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+	address[len] = '\0';
+	address[strcspn(address, "\n")] = '\0';
+	return pid;
+}
+
+/*
+ * The stub powerd. It counts HandleUserActivity calls and those that asked
+ * for a reply, never answers IncreaseScreenBrightness and fails
+ * DecreaseScreenBrightness. GetCounts returns both counts. As the display
+ * owner, it grants the first ReleaseDisplayOwnership and fails the others.
+ */
+static void run_powerd(int ready_fd)
+{
+	DBusConnection* conn;
+	DBusMessage* msg;
+	int32_t activities = 0, want_reply = 0, releases = 0;
+
+	conn = dbus_bus_get_private(DBUS_BUS_SYSTEM, NULL);
+	if (!conn ||
+	    dbus_bus_request_name(conn, kPowerManagerServiceName,
+				  DBUS_NAME_FLAG_DO_NOT_QUEUE, NULL) !=
+	    DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER ||
+	    dbus_bus_request_name(conn, kLibCrosServiceName,
+				  DBUS_NAME_FLAG_DO_NOT_QUEUE, NULL) !=
+	    DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+		_exit(1);
+	if (write(ready_fd, "1", 1) != 1)
+		_exit(1);
+	close(ready_fd);
+
+	while (dbus_connection_read_write(conn, -1)) {
+		while ((msg = dbus_connection_pop_message(conn))) {
+			DBusMessage* reply = NULL;
+
+			if (dbus_message_is_method_call(msg,
+					kPowerManagerInterface,
+					kHandleUserActivityMethod)) {
+				activities++;
+				if (!dbus_message_get_no_reply(msg))
+					want_reply++;
+			} else if (dbus_message_is_method_call(msg,
+					kPowerManagerInterface,
+					kDecreaseScreenBrightnessMethod)) {
+				reply = dbus_message_new_error(msg, TEST_ERROR,
+							       "stub powerd");
+			} else if (dbus_message_is_method_call(msg,
+					kLibCrosServiceInterface,
+					kReleaseDisplayOwnership)) {
+				if (releases++ == 0)
+					reply = dbus_message_new_method_return(
+							msg);
+				else
+					reply = dbus_message_new_error(msg,
+							TEST_ERROR,
+							"stub display owner");
+			} else if (dbus_message_is_method_call(msg,
+					kPowerManagerInterface,
+					TEST_GET_COUNTS)) {
+				reply = dbus_message_new_method_return(msg);
+				dbus_message_append_args(reply,
+					DBUS_TYPE_INT32, &activities,
+					DBUS_TYPE_INT32, &want_reply,
+					DBUS_TYPE_INVALID);
+			}
+
+			if (reply) {
+				dbus_connection_send(conn, reply, NULL);
+				dbus_message_unref(reply);
+			}
+			dbus_message_unref(msg);
+		}
+	}
+	_exit(0);
+}
+
+static pid_t start_powerd(void)
+{
+	int fds[2];
+	char c;
+	pid_t pid;
+
+	if (pipe(fds) < 0)
+		return -1;
+
+	pid = fork();
+	if (pid == 0) {
+		close(fds[0]);
+		run_powerd(fds[1]);
+	}
+	close(fds[1]);
+
+	if (read(fds[0], &c, 1) != 1) {
+		close(fds[0]);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+	close(fds[0]);
+	return pid;
+}
+
+/* Asks the stub powerd for its counts over a connection of our own. */
+static bool get_powerd_counts(int32_t* activities, int32_t* want_reply)
+{
+	DBusConnection* conn;
+	DBusMessage* msg;
+	DBusMessage* reply;
+	bool ret = false;
+
+	conn = dbus_bus_get_private(DBUS_BUS_SYSTEM, NULL);
+	if (!conn)
+		return false;
+
+	msg = dbus_message_new_method_call(kPowerManagerServiceName,
+			kPowerManagerServicePath, kPowerManagerInterface,
+			TEST_GET_COUNTS);
+	reply = dbus_connection_send_with_reply_and_block(conn, msg,
+			DBUS_DEFAULT_DELAY, NULL);
+	if (reply) {
+		ret = dbus_message_get_args(reply, NULL,
+				DBUS_TYPE_INT32, activities,
+				DBUS_TYPE_INT32, want_reply,
+				DBUS_TYPE_INVALID);
+		dbus_message_unref(reply);
+	}
+	dbus_message_unref(msg);
+	dbus_connection_close(conn);
+	dbus_connection_unref(conn);
+	return ret;
+}
+
+static bool log_contains(int log_fd, const char* text)
+{
+	char buf[4096];
+	ssize_t len = pread(log_fd, buf, sizeof(buf) - 1, 0);
+
+	if (len <= 0)
+		return false;
+	buf[len] = '\0';
+	return strstr(buf, text) != NULL;
+}
+
+static void release_done(bool success, void* userptr)
+{
+	if (success)
+		releases_ok++;
+	else
+		releases_failed++;
+}
+
+/* Runs the event loop until both brightness calls have been answered. */
+static void wait_for_replies(int log_fd)
+{
+	int64_t deadline = now_ms() + TEST_REPLY_WAIT_MS;
+
+	while (now_ms() < deadline) {
+		if (log_contains(log_fd, kIncreaseScreenBrightnessMethod) &&
+		    log_contains(log_fd, kDecreaseScreenBrightnessMethod))
+			return;
+		event_dispatch(100);
+	}
+}
+
+static void wait_for_releases(int count)
+{
+	int64_t deadline = now_ms() + TEST_REPLY_WAIT_MS;
+
+	while (releases_ok + releases_failed < count && now_ms() < deadline)
+		event_dispatch(100);
+}
+
+int main(void)
+{
+	char address[256];
+	char log_name[] = "/tmp/dbus_test.XXXXXX";
+	int32_t activities = 0, want_reply = 0;
+	pid_t bus, powerd;
+	int64_t start, elapsed;
+	int log_fd, stderr_fd, held;
+
+	bus = start_bus(address, sizeof(address));
+	if (bus < 0) {
+		printf("dbus-daemon could not be started, skipping\n");
+		return 0;
+	}
+	setenv("DBUS_SYSTEM_BUS_ADDRESS", address, 1);
+
+	powerd = start_powerd();
+	check(powerd > 0, "stub powerd owns its name");
+	if (powerd < 0) {
+		kill(bus, SIGTERM);
+		return 1;
+	}
+
+	/* Warnings from dbus.c go to stderr, keep them to look at. */
+	log_fd = mkstemp(log_name);
+	unlink(log_name);
+	stderr_fd = dup(STDERR_FILENO);
+	dup2(log_fd, STDERR_FILENO);
+
+	check(!event_init(), "event_init()");
+	check(dbus_init(), "dbus_init()");
+
+	start = now_ms();
+	for (int i = 0; i < 20; i++)
+		dbus_report_user_activity(USER_ACTIVITY_OTHER);
+	dbus_report_user_activity(USER_ACTIVITY_BRIGHTNESS_UP_KEY_PRESS);
+	dbus_report_user_activity(USER_ACTIVITY_BRIGHTNESS_DOWN_KEY_PRESS);
+	elapsed = now_ms() - start;
+
+	wait_for_replies(log_fd);
+
+	held = allocations;
+	check(dbus_release_display_ownership(release_done, NULL) &&
+	      dbus_release_display_ownership(release_done, NULL),
+	      "ReleaseDisplayOwnership is sent");
+	wait_for_releases(2);
+	dup2(stderr_fd, STDERR_FILENO);
+	close(stderr_fd);
+
+	check(elapsed < DBUS_DEFAULT_DELAY / 10,
+	      "reports do not wait for powerd");
+	check(log_contains(log_fd, "DecreaseScreenBrightness failed: "
+			   TEST_ERROR), "error reply is handled");
+	check(log_contains(log_fd, "IncreaseScreenBrightness failed: "
+			   DBUS_ERROR_NO_REPLY), "missing reply times out");
+	check(get_powerd_counts(&activities, &want_reply),
+	      "stub powerd answers GetCounts");
+	check(activities == 3, "repeated activity is coalesced");
+	check(want_reply == 0, "activity asks for no reply");
+	check(releases_ok == 1 && releases_failed == 1,
+	      "release replies reach the callback");
+	check(allocations == held, "pending call data is freed");
+	close(log_fd);
+
+	dbus_destroy();
+	event_close();
+	kill(powerd, SIGTERM);
+	kill(bus, SIGTERM);
+	waitpid(powerd, NULL, 0);
+	waitpid(bus, NULL, 0);
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2016 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Checks that every glyph row expansion kernel the CPU supports produces
+ * the same pixels as expand_row_scalar(), for all byte values and widths
+ * of 1 to 64 pixels, and that none writes past the end of the row.
+ */
+
+#include <string.h>
+
+#include "../font.c"
+
+#define MAX_WIDTH 64
+#define GUARD 8
+#define FRONT_COLOR 0xffc0ffee
+#define BACK_COLOR 0x00123456
+#define GUARD_COLOR 0xdeadbeef
+
+typedef struct {
+	const char* name;
+	expand_row_t expand;
+} kernel_t;
+
+static int check_kernel(const kernel_t* kernel)
+{
+	uint8_t src[MAX_WIDTH / 8];
+	uint32_t expected[MAX_WIDTH + GUARD];
+	uint32_t actual[MAX_WIDTH + GUARD];
+	int failures = 0;
+
+	for (int value = 0; value < 256; value++) {
+		/* Every byte position sees every value over the loop. */
+		for (unsigned k = 0; k < sizeof(src); k++)
+			src[k] = value + k * 0x3b;
+
+		for (int width = 1; width <= MAX_WIDTH; width++) {
+			for (int i = 0; i < MAX_WIDTH + GUARD; i++)
+				expected[i] = actual[i] = GUARD_COLOR;
+
+			expand_row_scalar(expected, src, width,
+					  FRONT_COLOR, BACK_COLOR);
+			kernel->expand(actual, src, width,
+				       FRONT_COLOR, BACK_COLOR);
+
+			if (memcmp(expected, actual, sizeof(actual))) {
+				if (failures++ < 10)
+					fprintf(stderr, "%s: mismatch for byte 0x%02x, width %d\n",
+						kernel->name, value, width);
+			}
+		}
+	}
+
+	printf("%-6s %s\n", kernel->name, failures ? "FAILED" : "ok");
+	return failures;
+}
+
+int main(void)
+{
+	kernel_t kernels[4];
+	int count = 0;
+	int failures = 0;
+
+	kernels[count++] = (kernel_t) { "scalar", expand_row_scalar };
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		kernels[count++] = (kernel_t) { "sse2", expand_row_sse2 };
+	if (__builtin_cpu_supports("avx2"))
+		kernels[count++] = (kernel_t) { "avx2", expand_row_avx2 };
+#elif defined(__ARM_NEON)
+	kernels[count++] = (kernel_t) { "neon", expand_row_neon };
+#endif
+
+	for (int i = 0; i < count; i++)
+		failures += check_kernel(&kernels[i]);
+
+	return failures ? 1 : 0;
+}
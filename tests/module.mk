@@ -0,0 +1,21 @@
+# Copyright 2016 The Chromium OS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+
+include common.mk
+
+tests/expand_row_test.o.depends: $(OUT)glyphs.h
+CC_BINARY(tests/expand_row_test): tests/expand_row_test.o util.o
+tests: TEST(CC_BINARY(tests/expand_row_test))
+
+CC_BINARY(tests/ring_test): tests/ring_test.o util.o
+tests: TEST(CC_BINARY(tests/ring_test))
+
+CC_BINARY(tests/render_test): tests/render_test.o render.o event.o shl_pty.o util.o
+tests: TEST(CC_BINARY(tests/render_test))
+
+# DBUS defaults to 1 in the Makefile, which is read after this file.
+ifneq ($(DBUS),0)
+CC_BINARY(tests/dbus_test): tests/dbus_test.o event.o util.o
+tests: TEST(CC_BINARY(tests/dbus_test))
+endif
@@ -0,0 +1,479 @@
+/*
+ * Copyright 2016 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Runs term.c with --render-thread against a fake fb, font and libtsm, and
+ * calls every entry point that touches the framebuffer or the font while a
+ * frame is being drawn on the render thread. The fakes record any such
+ * access from the main thread that happens before the frame is done, that
+ * is, a render_wait() missing in term.c.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../term.c"
+
+#define WIDTH 640
+#define HEIGHT 480
+#define CHAR_WIDTH 8
+#define CHAR_HEIGHT 16
+#define ROUNDS 40
+/* Keeps each frame on the render thread long enough to be caught. */
+#define FRAME_DELAY_US 2000
+
+commandflags_t command_flags;
+
+static pthread_t main_thread;
+static int violations;
+static unsigned frames_drawn;
+
+/* Called by every fake that must not run while a frame is in flight. */
+static void check_idle(const char* what)
+{
+	if (!pthread_equal(pthread_self(), main_thread) || !render_busy())
+		return;
+
+	if (violations++ < 10)
+		fprintf(stderr, "%s() called while a frame is drawn\n", what);
+}
+
+/* Fake fb, a malloc()ed buffer that never scrolls or flips. */
+
+fb_t* fb_init(void)
+{
+	fb_t* fb = calloc(1, sizeof(*fb));
+
+	if (!fb)
+		return NULL;
+	fb->buffer_properties.width = WIDTH;
+	fb->buffer_properties.height = HEIGHT;
+	fb->buffer_properties.pitch = WIDTH * 4;
+	fb->buffer_properties.scaling = 1;
+	fb->buffer_properties.size = WIDTH * HEIGHT * 4;
+	fb->buffer_properties.refresh = 60;
+	fb_buffer_init(fb);
+	return fb;
+}
+
+void fb_close(fb_t* fb)
+{
+	check_idle(__func__);
+	fb_buffer_destroy(fb);
+	free(fb);
+}
+
+int32_t fb_setmode(fb_t* fb)
+{
+	check_idle(__func__);
+	return 0;
+}
+
+int fb_buffer_init(fb_t* fb)
+{
+	check_idle(__func__);
+	fb->lock.map = calloc(WIDTH * HEIGHT, 4);
+	return fb->lock.map ? 0 : -1;
+}
+
+void fb_buffer_destroy(fb_t* fb)
+{
+	check_idle(__func__);
+	free(fb->lock.map);
+	fb->lock.map = NULL;
+}
+
+uint32_t* fb_lock(fb_t* fb)
+{
+	check_idle(__func__);
+	fb->lock.count++;
+	return fb->lock.map;
+}
+
+void fb_unlock(fb_t* fb)
+{
+	check_idle(__func__);
+	fb->lock.count--;
+}
+
+bool fb_flip_pending(fb_t* fb)
+{
+	return false;
+}
+
+bool fb_can_scroll(fb_t* fb)
+{
+	return false;
+}
+
+bool fb_scroll(fb_t* fb, int32_t lines)
+{
+	check_idle(__func__);
+	return false;
+}
+
+void fb_damage(fb_t* fb, int32_t x, int32_t y, int32_t w, int32_t h)
+{
+	check_idle(__func__);
+}
+
+int32_t fb_getwidth(fb_t* fb)
+{
+	return fb->buffer_properties.width;
+}
+
+int32_t fb_getheight(fb_t* fb)
+{
+	return fb->buffer_properties.height;
+}
+
+int32_t fb_getpitch(fb_t* fb)
+{
+	return fb->buffer_properties.pitch;
+}
+
+int32_t fb_getscaling(fb_t* fb)
+{
+	return fb->buffer_properties.scaling;
+}
+
+int32_t fb_getrefresh(fb_t* fb)
+{
+	return fb->buffer_properties.refresh;
+}
+
+int64_t fb_getsize(fb_t* fb)
+{
+	return fb->buffer_properties.size;
+}
+
+/* Fake font, every glyph is a block of the front color. */
+
+void font_init(int scaling)
+{
+	check_idle(__func__);
+}
+
+void font_free(void)
+{
+	check_idle(__func__);
+}
+
+void font_get_size(uint32_t* char_width, uint32_t* char_height)
+{
+	*char_width = CHAR_WIDTH;
+	*char_height = CHAR_HEIGHT;
+}
+
+bool font_space_is_blank(void)
+{
+	return true;
+}
+
+static void fill_cells(uint32_t* dst, int x, int y, int32_t pitch,
+		       int count, uint32_t color)
+{
+	dst += y * CHAR_HEIGHT * (pitch / 4) + x * CHAR_WIDTH;
+	for (int r = 0; r < CHAR_HEIGHT; r++, dst += pitch / 4)
+		for (int c = 0; c < count * CHAR_WIDTH; c++)
+			dst[c] = color;
+}
+
+void font_fill_span(uint32_t* dst_pointer, int dst_char_x, int dst_char_y,
+		    int32_t pitch, int count, uint32_t back_color)
+{
+	check_idle(__func__);
+	fill_cells(dst_pointer, dst_char_x, dst_char_y, pitch, count,
+		   back_color);
+}
+
+void font_render_span(uint32_t* dst_pointer, int dst_char_x, int dst_char_y,
+		      int32_t pitch, const uint32_t* chars, int count,
+		      uint32_t front_color, uint32_t back_color)
+{
+	check_idle(__func__);
+	if (dst_char_x == 0 && dst_char_y == 0) {
+		frames_drawn++;
+		usleep(FRAME_DELAY_US);
+	}
+	fill_cells(dst_pointer, dst_char_x, dst_char_y, pitch, count,
+		   front_color);
+}
+
+/* Fake libtsm, whose screen changes every cell on every draw. */
+
+struct tsm_screen {
+	unsigned int cols, rows;
+	tsm_age_t age;
+};
+
+struct tsm_vte {
+	struct tsm_screen* screen;
+};
+
+int tsm_screen_new(struct tsm_screen** out, tsm_log_t log, void* log_data)
+{
+	*out = calloc(1, sizeof(**out));
+	return *out ? 0 : -ENOMEM;
+}
+
+int tsm_screen_resize(struct tsm_screen* con, unsigned int x, unsigned int y)
+{
+	con->cols = x;
+	con->rows = y;
+	return 0;
+}
+
+tsm_age_t tsm_screen_draw(struct tsm_screen* con, tsm_screen_draw_cb draw_cb,
+			  void* data)
+{
+	struct tsm_screen_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	con->age++;
+	for (unsigned int y = 0; y < con->rows; y++) {
+		for (unsigned int x = 0; x < con->cols; x++) {
+			uint32_t ch = 'a' + (x + y + con->age) % 26;
+
+			attr.fr = x;
+			attr.fg = y;
+			attr.fb = con->age;
+			draw_cb(con, 0, &ch, 1, 1, x, y, &attr, con->age, data);
+		}
+	}
+	return con->age;
+}
+
+void tsm_screen_set_max_sb(struct tsm_screen* con, unsigned int max) {}
+void tsm_screen_sb_up(struct tsm_screen* con, unsigned int num) {}
+void tsm_screen_sb_down(struct tsm_screen* con, unsigned int num) {}
+void tsm_screen_sb_page_up(struct tsm_screen* con, unsigned int num) {}
+void tsm_screen_sb_page_down(struct tsm_screen* con, unsigned int num) {}
+void tsm_screen_sb_reset(struct tsm_screen* con) {}
+void tsm_screen_erase_screen(struct tsm_screen* con, bool protect) {}
+
+int tsm_vte_new(struct tsm_vte** out, struct tsm_screen* con,
+		tsm_vte_write_cb write_cb, void* data, tsm_log_t log,
+		void* log_data)
+{
+	*out = calloc(1, sizeof(**out));
+	return *out ? 0 : -ENOMEM;
+}
+
+void tsm_vte_set_osc_cb(struct tsm_vte* vte, tsm_vte_osc_cb osc_cb, void* data) {}
+void tsm_vte_input(struct tsm_vte* vte, const char* u8, size_t len) {}
+
+bool tsm_vte_handle_keyboard(struct tsm_vte* vte, uint32_t keysym,
+			     uint32_t ascii, unsigned int mods,
+			     uint32_t unicode)
+{
+	return false;
+}
+
+/* Fake image, loads nothing and shows nothing. */
+
+struct _image_t {
+	char* filename;
+};
+
+image_t* image_create()
+{
+	return calloc(1, sizeof(image_t));
+}
+
+void image_set_filename(image_t* image, char* filename)
+{
+	image->filename = filename;
+}
+
+char* image_get_filename(image_t* image)
+{
+	return image->filename;
+}
+
+void image_set_offset(image_t* image, int32_t offset_x, int32_t offset_y) {}
+void image_set_location(image_t* image, uint32_t location_x,
+			uint32_t location_y) {}
+void image_set_scale(image_t* image, uint32_t scale) {}
+
+int image_load_image_from_file(image_t* image)
+{
+	return 0;
+}
+
+int image_show(image_t* image, fb_t* fb)
+{
+	check_idle(__func__);
+	return 0;
+}
+
+void image_destroy(image_t* image)
+{
+	free(image);
+}
+
+int32_t image_get_auto_scale(fb_t* fb)
+{
+	return 1;
+}
+
+/* The rest of frecon. */
+
+bool input_pending(void)
+{
+	return false;
+}
+
+void dbus_take_display_ownership(void)
+{
+	check_idle(__func__);
+}
+
+bool dbus_release_display_ownership(dbus_reply_callback_t callback,
+				    void* userptr)
+{
+	return false;
+}
+
+int drm_dropmaster(drm_t* drm)
+{
+	check_idle(__func__);
+	return 0;
+}
+
+int drm_setmaster(drm_t* drm)
+{
+	check_idle(__func__);
+	return 0;
+}
+
+bool drm_rescan(void)
+{
+	check_idle(__func__);
+	return true;
+}
+
+bool set_drm_master_relax(void)
+{
+	return true;
+}
+
+/* Starts a frame of |terminal| on the render thread. */
+static bool start_frame(terminal_t* terminal)
+{
+	term_render(terminal);
+	return render_busy();
+}
+
+static void osc(terminal_t* terminal, const char* s)
+{
+	uint32_t u32[64];
+	size_t len = strlen(s);
+
+	for (size_t i = 0; i < len; i++)
+		u32[i] = s[i];
+	term_osc_cb(NULL, u32, len, terminal);
+}
+
+int main(void)
+{
+	terminal_t* terminals[2];
+	unsigned missed = 0;
+	int round, site;
+	static const char* const sites[] = {
+		"term_render", "term_osc_cb(box)", "term_osc_cb(image)",
+		"term_resize", "term_activate", "term_show_image",
+		"term_monitor_hotplug", "term_redrm", "term_background",
+		"term_dispatch_redraw",
+	};
+	const int num_sites = sizeof(sites) / sizeof(sites[0]);
+
+	main_thread = pthread_self();
+	command_flags.render_thread = true;
+	command_flags.no_login = true;
+	if (event_init() < 0)
+		return 1;
+
+	term_set_num_terminals(2);
+	for (int i = 0; i < 2; i++) {
+		terminals[i] = term_init(i, -1);
+		if (!terminals[i])
+			return 1;
+		term_set_terminal(i, terminals[i]);
+	}
+	term_activate(terminals[0]);
+
+	srand(1);
+	for (round = 0; round < ROUNDS; round++) {
+		for (int n = 0; n < num_sites; n++) {
+			terminal_t* terminal = term_get_current_terminal();
+
+			site = (n + rand()) % num_sites;
+			if (!start_frame(terminal)) {
+				missed++;
+				continue;
+			}
+
+			switch (site) {
+			case 0:
+				term_render(terminal);
+				break;
+			case 1:
+				osc(terminal, "box:color=0xff0000;size=16,16");
+				break;
+			case 2:
+				osc(terminal, "image:file=/dev/null");
+				break;
+			case 3:
+				term_resize(terminal);
+				break;
+			case 4:
+				term_activate(terminals[terminal == terminals[0]]);
+				break;
+			case 5:
+				term_show_image(terminal, NULL);
+				break;
+			case 6:
+				term_monitor_hotplug();
+				break;
+			case 7:
+				term_redrm(terminal);
+				break;
+			case 8:
+				term_background();
+				in_background = false;
+				break;
+			case 9:
+				terminal->redraw_pending = true;
+				redraw_frame_due = true;
+				term_dispatch_redraw();
+				if (!terminal->redraw_deferred) {
+					fprintf(stderr, "term_dispatch_redraw() did not defer the frame\n");
+					violations++;
+				}
+				break;
+			}
+		}
+	}
+
+	/* The last frame is still in flight. */
+	term_close(terminals[1]);
+	term_set_terminal(1, NULL);
+	term_close(terminals[0]);
+	term_set_terminal(0, NULL);
+	render_close();
+	event_close();
+
+	printf("%u frames drawn, %u not started\n", frames_drawn, missed);
+	if (violations || missed) {
+		printf("FAILED\n");
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright 2016 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Runs random pushes, peeks and pops, including pastes that make the ring
+ * grow while its data wraps around, against the shl_pty output ring. The
+ * ring is checked once as a mirrored memfd ring and once pinned to the
+ * heap fallback.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Newer C libraries no longer define it, shl_pty.c only needs the count. */
+#ifndef SIGUNUSED
+#define SIGUNUSED SIGSYS
+#endif
+
+#include "../shl_pty.c"
+
+#define OPERATIONS 200000
+#define MAX_PASTE (150 * 1024)
+
+/* Byte number |pos| of the stream pushed into the ring. */
+static char stream_byte(size_t pos)
+{
+	return (char)(pos * 131 + (pos >> 9));
+}
+
+static int check_ring(const char* name, bool heap)
+{
+	static char chunk[MAX_PASTE];
+	struct ring r = { .fd = -1 };
+	struct iovec vec[2];
+	size_t pushed = 0, popped = 0;
+	int failures = 0;
+
+	srand(1);
+	if (heap && ring_resize_heap(&r, sysconf(_SC_PAGESIZE)) < 0)
+		return 1;
+
+	for (int op = 0; op < OPERATIONS && failures < 10; op++) {
+		size_t len, num, pos;
+
+		switch (rand() % 3) {
+		case 0:
+			/* Mostly key presses and replies, now and then a paste. */
+			len = rand() % 100 ? 1 + rand() % 64 : 1 + rand() % MAX_PASTE;
+			for (size_t i = 0; i < len; i++)
+				chunk[i] = stream_byte(pushed + i);
+			if (ring_push(&r, chunk, len) < 0) {
+				fprintf(stderr, "%s: push of %zu bytes failed\n",
+					name, len);
+				failures++;
+				break;
+			}
+			pushed += len;
+			break;
+		case 1:
+			num = ring_peek(&r, vec);
+			pos = popped;
+			for (size_t i = 0; i < num; i++)
+				for (size_t k = 0; k < vec[i].iov_len; k++)
+					if (((char*)vec[i].iov_base)[k] !=
+					    stream_byte(pos++)) {
+						failures++;
+						break;
+					}
+			if (pos != pushed) {
+				fprintf(stderr, "%s: peek returned %zu of %zu bytes\n",
+					name, pos - popped, pushed - popped);
+				failures++;
+			}
+			if (num == 2 && r.mirrored) {
+				fprintf(stderr, "%s: mirrored ring split a peek\n",
+					name);
+				failures++;
+			}
+			break;
+		default:
+			len = rand() % 8192;
+			ring_pop(&r, len);
+			popped += len < pushed - popped ? len : pushed - popped;
+			break;
+		}
+	}
+
+	if (r.mirrored == heap) {
+		fprintf(stderr, "%s: ring is %s\n", name,
+			r.mirrored ? "mirrored" : "on the heap");
+		failures++;
+	}
+	ring_free(&r);
+
+	printf("%-9s %s\n", name, failures ? "FAILED" : "ok");
+	return failures;
+}
+
+int main(void)
+{
+	int failures = 0;
+
+	failures += check_ring("mirrored", false);
+	failures += check_ring("heap", true);
+
+	return failures ? 1 : 0;
+}